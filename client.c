@@ -15,12 +15,20 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
+#include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <uint64.h>
+
 #include "client.h"
 
 #ifndef SUN_LEN
@@ -55,7 +63,7 @@ static int jwrite(journald_client* j, const char* data, uint32 size)
     data += length;
     size -= length;
     j->bufpos += length;
-    if (jflush(j) == -1) return 0;
+    if (!jflush(j)) return 0;
   }
   memcpy(j->buf+j->bufpos, data, size);
   j->bufpos += size;
@@ -65,38 +73,100 @@ static int jwrite(journald_client* j, const char* data, uint32 size)
 int journald_write(journald_client* j, const char* data, uint32 size)
 {
   char buf[4];
-  uint32_pack_lsb(size, buf);
+  uint32_pack_msb(size, buf);
   
   return jwrite(j, buf, 4) && jwrite(j, data, size);
 }
 
-journald_client* journald_open(const char* path, const char* ident)
+static int connect_stream(const char* path)
 {
   size_t size;
   struct sockaddr_un* saddr;
   int fd;
-  journald_client* j;
   
   fd = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (fd == -1) return 0;
+  if (fd == -1) return -1;
   size = sizeof(struct sockaddr_un) + strlen(path) + 1;
   saddr = (struct sockaddr_un*)malloc(size);
   saddr->sun_family = AF_UNIX;
   strcpy(saddr->sun_path, path);
-  if (connect(fd, (struct sockaddr*)saddr, SUN_LEN(saddr)) == -1) return 0;
+  if (connect(fd, (struct sockaddr*)saddr, SUN_LEN(saddr)) == -1) {
+    free(saddr);
+    close(fd);
+    return -1;
+  }
   free(saddr);
+  return fd;
+}
+
+/* Adds a record holding length bytes of the file open on fd, starting
+   at offset.  Only the descriptor is sent, and the daemon reads the data
+   itself, so the file must not be changed until the transaction has
+   been acknowledged.  The length may be at most 2^31-1. */
+int journald_write_fd(journald_client* j, int fd, uint64 offset,
+		      uint32 length)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  char buf[12];
+
+  if (length == 0 || (length & 0x80000000)) return 0;
+  /* The descriptor must arrive with its own record, so everything before
+     it is sent first. */
+  if (!jflush(j)) return 0;
+  uint32_pack_msb(length | 0x80000000, buf);
+  uint32_pack_msb((uint32)(offset >> 32), buf + 4);
+  uint32_pack_msb((uint32)offset, buf + 8);
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = buf;
+  iov.iov_len = sizeof buf;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof control.buf;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  return sendmsg(j->fd, &msg, 0) == sizeof buf;
+}
+
+journald_client* journald_open_priority(const char* path, const char* ident,
+					int priority)
+{
+  int fd;
+  journald_client* j;
+  char buf[4];
+  uint32 length;
+  
+  if ((fd = connect_stream(path)) == -1) return 0;
 
   j = malloc(sizeof(journald_client));
   memset(j, 0, sizeof(journald_client));
   j->fd = fd;
-  
-  if (!journald_write(j, ident, strlen(ident))) {
+
+  /* The priority class is sent in the top byte of the ident length. */
+  length = strlen(ident);
+  uint32_pack_msb(length | ((uint32)priority << 24), buf);
+  if (!jwrite(j, buf, 4) || !jwrite(j, ident, length)) {
+    close(fd);
     free(j);
     j = 0;
   }
   return j;
 }
 
+journald_client* journald_open(const char* path, const char* ident)
+{
+  return journald_open_priority(path, ident, JOURNALD_NORMAL);
+}
+
 static int read_status_close(journald_client* j)
 {
   char tmp[1];
@@ -114,12 +184,278 @@ int journald_close(journald_client* j)
   return read_status_close(j);
 }
 
+/* Sends the whole transaction as one datagram to the daemon's datagram
+   socket, and waits for the response on the same socket.  Returns -1 if
+   the datagram socket could not be used, in which case nothing has been
+   sent.  Unlike a stream connection, a lost response or a daemon that
+   dies after receiving gives no end of file, so the wait is bounded. */
+static int oneshot_dgram(const char* path, const char* ident,
+			 const char* data, uint32 length)
+{
+  struct sockaddr_un* saddr;
+  struct sockaddr_un local;
+  struct pollfd p;
+  uint32 identlen;
+  uint32 size;
+  char* msg;
+  char tmp[1];
+  int fd;
+  int result;
+
+  identlen = strlen(ident);
+  size = 4 + identlen + 4 + length + 4;
+  if (size > JOURNALD_DGRAM_MAX) return -1;
+  if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) return -1;
+  /* Binding with only the address family requests an automatically
+     assigned (abstract) address, which the response is sent to. */
+  memset(&local, 0, sizeof local);
+  local.sun_family = AF_UNIX;
+  saddr = malloc(sizeof(struct sockaddr_un) + strlen(path) + 7);
+  msg = malloc(size);
+  result = -1;
+  if (saddr && msg
+      && bind(fd, (struct sockaddr*)&local, sizeof local.sun_family) == 0) {
+    saddr->sun_family = AF_UNIX;
+    strcpy(saddr->sun_path, path);
+    strcat(saddr->sun_path, ".dgram");
+    if (connect(fd, (struct sockaddr*)saddr, SUN_LEN(saddr)) == 0) {
+      uint32_pack_msb(identlen, msg);
+      memcpy(msg + 4, ident, identlen);
+      uint32_pack_msb(length, msg + 4 + identlen);
+      memcpy(msg + 8 + identlen, data, length);
+      uint32_pack_msb(0, msg + 8 + identlen + length);
+      if (send(fd, msg, size, 0) == (long)size) {
+	p.fd = fd;
+	p.events = POLLIN;
+	result = (poll(&p, 1, JOURNALD_DGRAM_TIMEOUT * 1000) == 1
+		  && read(fd, tmp, 1) == 1) ? tmp[0] : 0;
+      }
+    }
+  }
+  free(msg);
+  free(saddr);
+  close(fd);
+  return result;
+}
+
 int journald_oneshot(const char* path, const  char* ident,
 		     const char* data, uint32 length)
 {
   journald_client* j;
+  int result;
 
+  if ((result = oneshot_dgram(path, ident, data, length)) != -1)
+    return result;
   if (!(j = journald_open(path, ident))) return 0;
   if (!journald_write(j, data, length)) return 0;
   return read_status_close(j);
 }
+
+/* Receives the ring setup response: a status byte carrying the ring
+   memory file, the producer's eventfd, and the daemon's eventfd. */
+static int recv_fds(int sock, int* fds)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } control;
+  char status;
+
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = &status;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof control.buf;
+  if (recvmsg(sock, &msg, 0) != 1) return 0;
+  if ((cmsg = CMSG_FIRSTHDR(&msg)) == 0
+      || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    return 0;
+  memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+  if (status != 1) {
+    close(fds[0]);
+    close(fds[1]);
+    close(fds[2]);
+    return 0;
+  }
+  return 1;
+}
+
+/* Opens a ring session.  The ring holds (at least) size_kb kilobytes of
+   transaction data, or a default size if size_kb is zero.  Every
+   transaction sent through the ring has the given priority class. */
+journald_ring* journald_ring_open(const char* path, uint32 size_kb,
+				  int priority)
+{
+  journald_ring* r;
+  struct stat st;
+  int fds[3];
+  char buf[4];
+  void* map;
+  int fd;
+
+  if ((fd = connect_stream(path)) == -1) return 0;
+  uint32_pack_msb(((uint32)(RING_REQUEST | priority) << 24)
+		  | (size_kb & 0xffffff), buf);
+  if (write(fd, buf, 4) != 4 || !recv_fds(fd, fds)) {
+    close(fd);
+    return 0;
+  }
+  map = MAP_FAILED;
+  if (fstat(fds[0], &st) == 0 && st.st_size > RING_HEADER_SIZE)
+    map = mmap(0, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fds[0], 0);
+  close(fds[0]);
+  if (map == MAP_FAILED || (r = malloc(sizeof *r)) == 0) {
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    close(fds[1]);
+    close(fds[2]);
+    close(fd);
+    return 0;
+  }
+  r->fd = fd;
+  r->data_fd = fds[1];
+  r->ack_fd = fds[2];
+  r->control = map;
+  r->data = (unsigned char*)map + RING_HEADER_SIZE;
+  r->size = r->control->size;
+  r->head = r->control->head;
+  r->submitted = 0;
+  r->priority = priority;
+  return r;
+}
+
+/* Makes the data added since the last call visible to the daemon,
+   waking it if it is waiting for data. */
+static void ring_publish(journald_ring* r)
+{
+  uint64 one = 1;
+  ring_barrier();
+  r->control->head = r->head;
+  ring_barrier();
+  if (r->control->server_waiting)
+    write(r->data_fd, &one, sizeof one);
+}
+
+/* Sleeps until the daemon signals progress.  Returns 0 if the daemon
+   has closed the connection. */
+static int ring_sleep(journald_ring* r)
+{
+  struct pollfd p[2];
+  uint64 count;
+  p[0].fd = r->ack_fd;
+  p[0].events = POLLIN;
+  p[1].fd = r->fd;
+  p[1].events = POLLIN;
+  if (poll(p, 2, -1) == -1) return errno == EINTR;
+  if (p[1].revents) return 0;
+  if (p[0].revents & POLLIN)
+    read(r->ack_fd, &count, sizeof count);
+  return 1;
+}
+
+static uint32 ring_space(const journald_ring* r)
+{
+  return r->size - (r->head - r->control->tail);
+}
+
+/* Waits until the daemon has made room in the ring. */
+static int ring_wait_space(journald_ring* r)
+{
+  struct ring_control* c = r->control;
+  ring_publish(r);
+  while (ring_space(r) == 0) {
+    c->client_waiting = 1;
+    ring_barrier();
+    if (ring_space(r) == 0 && !ring_sleep(r)) {
+      c->client_waiting = 0;
+      return 0;
+    }
+    c->client_waiting = 0;
+  }
+  return 1;
+}
+
+static int ring_put(journald_ring* r, const char* data, uint32 length)
+{
+  uint32 offset;
+  uint32 space;
+  while (length > 0) {
+    if (r->control->error) return 0;
+    if ((space = ring_space(r)) == 0) {
+      if (!ring_wait_space(r)) return 0;
+      continue;
+    }
+    offset = r->head & (r->size - 1);
+    if (space > r->size - offset) space = r->size - offset;
+    if (space > length) space = length;
+    memcpy(r->data + offset, data, space);
+    r->head += space;
+    data += space;
+    length -= space;
+  }
+  return 1;
+}
+
+int journald_ring_begin(journald_ring* r, const char* ident)
+{
+  char buf[4];
+  uint32 length;
+  length = strlen(ident);
+  uint32_pack_msb(length | ((uint32)r->priority << 24), buf);
+  return ring_put(r, buf, 4) && ring_put(r, ident, length);
+}
+
+int journald_ring_write(journald_ring* r, const char* data, uint32 length)
+{
+  char buf[4];
+  uint32_pack_msb(length, buf);
+  return ring_put(r, buf, 4) && ring_put(r, data, length);
+}
+
+/* Ends the current transaction and hands it to the daemon.  Returns the
+   transaction's sequence number, to be passed to journald_ring_wait, or
+   zero on error. */
+uint32 journald_ring_end(journald_ring* r)
+{
+  char buf[4];
+  uint32_pack_msb(0, buf);
+  if (!ring_put(r, buf, 4)) return 0;
+  ring_publish(r);
+  return ++r->submitted;
+}
+
+/* Waits until the transaction with the given sequence number (and every
+   one before it) has been committed.  Returns zero if any transaction in
+   the session has failed, after which the session must be closed. */
+int journald_ring_wait(journald_ring* r, uint32 seq)
+{
+  struct ring_control* c = r->control;
+  while ((c->completed - seq) & 0x80000000) {
+    if (c->error) return 0;
+    c->client_waiting = 1;
+    ring_barrier();
+    if (((c->completed - seq) & 0x80000000) && !c->error && !ring_sleep(r)) {
+      c->client_waiting = 0;
+      return 0;
+    }
+    c->client_waiting = 0;
+  }
+  return !c->error;
+}
+
+/* Closes the session.  A transaction that was begun but not ended is
+   aborted, and transactions not yet waited for may not be committed. */
+void journald_ring_close(journald_ring* r)
+{
+  munmap((void*)r->control, RING_HEADER_SIZE + r->size);
+  close(r->data_fd);
+  close(r->ack_fd);
+  close(r->fd);
+  free(r);
+}
@@ -2,8 +2,22 @@
 #define JOURNALD__CLIENT__H__
 
 #include <uint32.h>
+#include <uint64.h>
+
+#include "ring.h"
 
 #define JOURNALD_BUFSIZE 4096
+
+/* Transaction priority classes */
+#define JOURNALD_NORMAL 0
+#define JOURNALD_URGENT 1
+#define JOURNALD_BULK 2
+
+/* The largest transaction journald_oneshot will send as a datagram */
+#define JOURNALD_DGRAM_MAX 65536
+/* Seconds journald_oneshot waits for the datagram acknowledgement */
+#define JOURNALD_DGRAM_TIMEOUT 30
+
 struct journald_client
 {
   int fd;
@@ -13,9 +27,36 @@ struct journald_client
 typedef struct journald_client journald_client;
 
 journald_client* journald_open(const char* path, const char* ident);
+journald_client* journald_open_priority(const char* path, const char* ident,
+					int priority);
 int journald_write(journald_client* j, const char* data, uint32 length);
+int journald_write_fd(journald_client* j, int fd, uint64 offset,
+		      uint32 length);
 int journald_close(journald_client* j);
 int journald_oneshot(const char* path, const char* ident,
 		     const char* data, uint32 length);
 
+/* A shared memory ring session, see protocol.txt */
+struct journald_ring
+{
+  int fd;
+  int data_fd;
+  int ack_fd;
+  struct ring_control* control;
+  unsigned char* data;
+  uint32 size;
+  uint32 head;
+  uint32 submitted;
+  int priority;
+};
+typedef struct journald_ring journald_ring;
+
+journald_ring* journald_ring_open(const char* path, uint32 size_kb,
+				  int priority);
+int journald_ring_begin(journald_ring* r, const char* ident);
+int journald_ring_write(journald_ring* r, const char* data, uint32 length);
+uint32 journald_ring_end(journald_ring* r);
+int journald_ring_wait(journald_ring* r, uint32 seq);
+void journald_ring_close(journald_ring* r);
+
 #endif
@@ -0,0 +1,37 @@
+/* fdio.c - Complete writes to file descriptors.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <errno.h>
+#include <unistd.h>
+
+#include "fdio.h"
+
+/* Writes all of the data, retrying short and interrupted writes. */
+int write_all(int fd, const void* data, unsigned long len)
+{
+  const char* p = data;
+  long wr;
+  while (len > 0) {
+    if ((wr = write(fd, p, len)) == -1) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    p += wr;
+    len -= wr;
+  }
+  return 1;
+}
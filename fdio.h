@@ -0,0 +1,7 @@
+#ifndef JOURNALD__FDIO__H__
+#define JOURNALD__FDIO__H__
+
+/* fdio.c */
+extern int write_all(int fd, const void* data, unsigned long len);
+
+#endif
@@ -2,6 +2,10 @@
 #define JOURNALD__FLAGS__H__
 
 #define HEADER_SIZE (4+4+4+4+4)
+#define EOT_SIZE (HEADER_SIZE+8)
+#define FILE_HEADER_SIZE (8+4+4+4+4+8)
+#define HINT_SIZE (4+4+4+8)
+#define FILE_OPTIONS_MAX 64
 
 #define RECORD_TYPE 0xf
 #define RECORD_EOT 0
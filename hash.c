@@ -0,0 +1,315 @@
+/* hash.c - Record check code helpers.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <string.h>
+
+#include <crc/crc64.h>
+
+#include "hash.h"
+
+/*
+  The check code algorithm is chosen when a journal is created and
+  named in the file header options (as "check=NAME"), so readers and
+  resume use whatever the journal was written with.  CRC64 is the
+  default, and is written without an option, so such journals can be
+  read by older readers.  The file header's own check code is always
+  CRC64, since it has to be verified before the options are trusted.
+*/
+
+int hash_type = HASH_CRC64;
+
+const char* const hash_names[] = { "crc64", "crc32c", "xxh64", 0 };
+
+int hash_select(const char* name)
+{
+  int i;
+  for (i = 0; hash_names[i] != 0; ++i)
+    if (strcmp(name, hash_names[i]) == 0) {
+      hash_type = i;
+      return 1;
+    }
+  return 0;
+}
+
+static uint64 get64(const unsigned char* p)
+{
+  return (uint64)p[0] | ((uint64)p[1] << 8) | ((uint64)p[2] << 16)
+    | ((uint64)p[3] << 24) | ((uint64)p[4] << 32) | ((uint64)p[5] << 40)
+    | ((uint64)p[6] << 48) | ((uint64)p[7] << 56);
+}
+
+static uint32 get32(const unsigned char* p)
+{
+  return (uint32)p[0] | ((uint32)p[1] << 8) | ((uint32)p[2] << 16)
+    | ((uint32)p[3] << 24);
+}
+
+/* CRC32C (Castagnoli), using the SSE4.2 instruction when the processor
+   has it, and a table otherwise. */
+static uint32 crc32c_table[256];
+
+static uint32 crc32c_soft(uint32 crc, const unsigned char* p,
+			  unsigned long len)
+{
+  while (len--)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+static uint32 (*crc32c_update)(uint32, const unsigned char*, unsigned long);
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32 crc32c_sse42(uint32 crc, const unsigned char* p,
+			   unsigned long len)
+{
+  uint64 c = crc;
+  for (; len >= 8; len -= 8, p += 8)
+    c = __builtin_ia32_crc32di(c, get64(p));
+  crc = c;
+  while (len--)
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  return crc;
+}
+#endif
+
+static void crc32c_setup(void)
+{
+  uint32 crc;
+  int i;
+  int j;
+#if defined(__GNUC__) && defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_update = crc32c_sse42;
+    return;
+  }
+#endif
+  for (i = 0; i < 256; ++i) {
+    crc = i;
+    for (j = 0; j < 8; ++j)
+      crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78UL : 0);
+    crc32c_table[i] = crc;
+  }
+  crc32c_update = crc32c_soft;
+}
+
+/* xxh64, with a seed of zero. */
+#define P64_1 0x9e3779b185ebca87ULL
+#define P64_2 0xc2b2ae3d27d4eb4fULL
+#define P64_3 0x165667b19e3779f9ULL
+#define P64_4 0x85ebca77c2b2ae63ULL
+#define P64_5 0x27d4eb2f165667c5ULL
+
+#define rotl64(X,N) (((X) << (N)) | ((X) >> (64 - (N))))
+
+static uint64 xxh64_round(uint64 acc, uint64 input)
+{
+  acc += input * P64_2;
+  acc = rotl64(acc, 31);
+  return acc * P64_1;
+}
+
+static uint64 xxh64_merge(uint64 h, uint64 acc)
+{
+  h ^= xxh64_round(0, acc);
+  return h * P64_1 + P64_4;
+}
+
+static void xxh64_stripes(HASH_CTX* hash, const unsigned char* p,
+			  unsigned long count)
+{
+  uint64 a0 = hash->acc[0];
+  uint64 a1 = hash->acc[1];
+  uint64 a2 = hash->acc[2];
+  uint64 a3 = hash->acc[3];
+  for (; count > 0; --count, p += 32) {
+    a0 = xxh64_round(a0, get64(p));
+    a1 = xxh64_round(a1, get64(p+8));
+    a2 = xxh64_round(a2, get64(p+16));
+    a3 = xxh64_round(a3, get64(p+24));
+  }
+  hash->acc[0] = a0;
+  hash->acc[1] = a1;
+  hash->acc[2] = a2;
+  hash->acc[3] = a3;
+}
+
+static void xxh64_update(HASH_CTX* hash, const unsigned char* p,
+			 unsigned long len)
+{
+  unsigned n;
+  hash->total += len;
+  if (hash->buflen) {
+    n = 32 - hash->buflen;
+    if (n > len) n = len;
+    memcpy(hash->buf + hash->buflen, p, n);
+    hash->buflen += n;
+    p += n;
+    len -= n;
+    if (hash->buflen < 32) return;
+    xxh64_stripes(hash, hash->buf, 1);
+    hash->buflen = 0;
+  }
+  xxh64_stripes(hash, p, len / 32);
+  p += len & ~31UL;
+  len &= 31;
+  memcpy(hash->buf, p, len);
+  hash->buflen = len;
+}
+
+static uint64 xxh64_finish(const HASH_CTX* hash)
+{
+  const unsigned char* p = hash->buf;
+  unsigned len = hash->buflen;
+  uint64 h;
+  if (hash->total >= 32) {
+    h = rotl64(hash->acc[0], 1) + rotl64(hash->acc[1], 7)
+      + rotl64(hash->acc[2], 12) + rotl64(hash->acc[3], 18);
+    h = xxh64_merge(h, hash->acc[0]);
+    h = xxh64_merge(h, hash->acc[1]);
+    h = xxh64_merge(h, hash->acc[2]);
+    h = xxh64_merge(h, hash->acc[3]);
+  }
+  else
+    h = P64_5;
+  h += hash->total;
+  for (; len >= 8; len -= 8, p += 8) {
+    h ^= xxh64_round(0, get64(p));
+    h = rotl64(h, 27) * P64_1 + P64_4;
+  }
+  if (len >= 4) {
+    h ^= (uint64)get32(p) * P64_1;
+    h = rotl64(h, 23) * P64_2 + P64_3;
+    len -= 4;
+    p += 4;
+  }
+  for (; len > 0; --len, ++p) {
+    h ^= *p * P64_5;
+    h = rotl64(h, 11) * P64_1;
+  }
+  h ^= h >> 33;
+  h *= P64_2;
+  h ^= h >> 29;
+  h *= P64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+void hash_init_type(HASH_CTX* hash, int type)
+{
+  hash->type = type;
+  switch (type) {
+  case HASH_CRC32C:
+    if (crc32c_update == 0) crc32c_setup();
+    hash->state = 0xffffffffUL;
+    break;
+  case HASH_XXH64:
+    hash->acc[0] = P64_1 + P64_2;
+    hash->acc[1] = P64_2;
+    hash->acc[2] = 0;
+    hash->acc[3] = -P64_1;
+    hash->buflen = 0;
+    hash->total = 0;
+    break;
+  default:
+    hash->state = CRC64INIT;
+  }
+}
+
+void hash_update(HASH_CTX* hash, const void* data, unsigned long len)
+{
+  switch (hash->type) {
+  case HASH_CRC32C:
+    hash->state = crc32c_update(hash->state, data, len);
+    break;
+  case HASH_XXH64:
+    xxh64_update(hash, data, len);
+    break;
+  default:
+    hash->state = crc64_update(hash->state, data, len);
+  }
+}
+
+void hash_finish(HASH_CTX* hash, void* code)
+{
+  uint64 tmp;
+  switch (hash->type) {
+  case HASH_CRC32C:
+    tmp = ~hash->state & 0xffffffffUL;
+    break;
+  case HASH_XXH64:
+    tmp = xxh64_finish(hash);
+    break;
+  default:
+    tmp = ~hash->state;
+  }
+  memcpy(code, &tmp, sizeof tmp);
+}
+
+/* Writes the header options for the selected algorithm into buf, and
+   returns their length. */
+unsigned hash_make_options(unsigned char* buf)
+{
+  if (hash_type == HASH_CRC64) return 0;
+  memcpy(buf, "check=", 6);
+  strcpy((char*)buf + 6, hash_names[hash_type]);
+  return 6 + strlen(hash_names[hash_type]);
+}
+
+/* Returns the algorithm named by a list of header options, or -1 if
+   there is an option this version does not understand. */
+int hash_parse_options(const unsigned char* buf, unsigned len)
+{
+  const unsigned char* end = buf + len;
+  const unsigned char* item;
+  unsigned itemlen;
+  int type = HASH_CRC64;
+  int i;
+  while (buf < end) {
+    item = buf;
+    while (buf < end && *buf != 0) ++buf;
+    itemlen = buf - item;
+    if (buf < end) ++buf;
+    if (itemlen == 0) continue;
+    if (itemlen <= 6 || memcmp(item, "check=", 6) != 0) return -1;
+    for (i = 0; hash_names[i] != 0; ++i)
+      if (itemlen - 6 == strlen(hash_names[i])
+	  && memcmp(item + 6, hash_names[i], itemlen - 6) == 0)
+	break;
+    if (hash_names[i] == 0) return -1;
+    type = i;
+  }
+  return type;
+}
+
+/* Copies len bytes from src to dst, adding them to the check code.
+   The copy is done in blocks small enough to stay in the L1 cache, and
+   each block is hashed from the destination right after it is copied,
+   so the source is only read from memory once. */
+void hash_copy(HASH_CTX* hash, unsigned char* dst,
+	       const unsigned char* src, unsigned long len)
+{
+  unsigned long n;
+  while (len > 0) {
+    n = (len < HASH_COPY_BLOCK) ? len : HASH_COPY_BLOCK;
+    memcpy(dst, src, n);
+    hash_update(hash, dst, n);
+    dst += n;
+    src += n;
+    len -= n;
+  }
+}
@@ -1,12 +1,42 @@
 #ifndef JOURNALD__HASH__H__
 #define JOURNALD__HASH__H__
 
-#include <crc/crc64.h>
+#include <uint32.h>
+#include <uint64.h>
+
+/* The check code field is always 8 bytes.  CRC32C codes are stored in
+   the low 4 bytes, with the rest zero. */
 #define HASH_SIZE (sizeof(uint64))
-typedef uint64 HASH_CTX;
 
-#define hash_init(H) do{ *(H) = CRC64INIT; }while(0)
-#define hash_update(H,B,L) do{ *H = crc64_update(*H,B,L); }while(0)
-#define hash_finish(H,BUF) do{ uint64 tmp = ~(*(H)); memcpy(BUF, &tmp, sizeof tmp); }while(0)
+#define HASH_CRC64 0
+#define HASH_CRC32C 1
+#define HASH_XXH64 2
+
+typedef struct
+{
+  int type;
+  uint64 state;
+  uint64 acc[4];		/* xxh64 lanes */
+  unsigned char buf[32];	/* xxh64 partial stripe */
+  unsigned buflen;
+  uint64 total;
+} HASH_CTX;
+
+/* hash.c */
+extern int hash_type;		/* used for new journals and records */
+extern const char* const hash_names[];
+
+extern int hash_select(const char* name);
+extern void hash_init_type(HASH_CTX* hash, int type);
+extern void hash_update(HASH_CTX* hash, const void* data, unsigned long len);
+extern void hash_finish(HASH_CTX* hash, void* code);
+#define hash_init(H) hash_init_type(H, hash_type)
+
+extern unsigned hash_make_options(unsigned char* buf);
+extern int hash_parse_options(const unsigned char* buf, unsigned len);
+
+#define HASH_COPY_BLOCK 2048
+extern void hash_copy(HASH_CTX* hash, unsigned char* dst,
+		      const unsigned char* src, unsigned long len);
 
 #endif
@@ -5,6 +5,9 @@ void insthier(void) {
   int bin = opendir(conf_bin);
   c(bin, "journald-client", -1, -1, 0755);
   c(bin, "journald",        -1, -1, 0755);
+  c(bin, "journald-stats",  -1, -1, 0755);
+  c(bin, "journald-trace",  -1, -1, 0755);
   c(bin, "journal-dump",    -1, -1, 0755);
   c(bin, "journal-read",    -1, -1, 0755);
+  c(bin, "journal-index",   -1, -1, 0755);
 }
@@ -0,0 +1,160 @@
+/* jindex.c - Sidecar index of the streams in a journal.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <crc/crc64.h>
+#include <str/str.h>
+
+#include "fdio.h"
+#include "jindex.h"
+
+/*
+  The index is advisory: it may be missing entries for streams that
+  completed just before a crash, and can always be rebuilt from the
+  journal with journal-index.  It consists of a header, followed by one
+  fixed size entry for every completed stream in the order they were
+  committed.  Time marks, giving the offset of the first transaction
+  committed at a given time, are mixed in with the stream entries.
+  The header records the page size and first global record number of
+  the journal, which must match for the index to be used.
+*/
+
+static int fd = -1;
+static str pending;
+
+void jindex_hash(const char* ident, uint32 len,
+		 unsigned char hash[JINDEX_HASH_SIZE])
+{
+  uint64 crc;
+  crc = ~crc64_update(CRC64INIT, ident, len);
+  uint32_pack_lsb((uint32)crc, hash);
+  uint32_pack_lsb((uint32)(crc >> 32), hash+4);
+}
+
+static void make_header(unsigned char* buf, uint32 pagesize,
+			uint32 first_recnum)
+{
+  memcpy(buf, "journidx", 8);
+  uint32_pack_lsb(1, buf+8);
+  uint32_pack_lsb(pagesize, buf+12);
+  uint32_pack_lsb(first_recnum, buf+16);
+  uint32_pack_lsb(0, buf+20);
+}
+
+/* Open the index for appending.  If keep is set and the existing index
+   matches the journal, its entries are kept, otherwise it is emptied. */
+int jindex_open(const char* path, uint32 pagesize, uint32 first_recnum,
+		int keep)
+{
+  unsigned char header[JINDEX_HEADER_SIZE];
+  unsigned char old[JINDEX_HEADER_SIZE];
+  struct stat st;
+
+  make_header(header, pagesize, first_recnum);
+  if (fd != -1) close(fd);
+  if ((fd = open(path, O_RDWR|O_CREAT, 0666)) == -1) return 0;
+  if (keep
+      && read(fd, old, sizeof old) == sizeof old
+      && memcmp(old, header, sizeof header) == 0
+      && fstat(fd, &st) == 0) {
+    /* Drop any partially written entry at the end. */
+    st.st_size -= (st.st_size - JINDEX_HEADER_SIZE) % JINDEX_ENTRY_SIZE;
+    if (ftruncate(fd, st.st_size) == -1) return 0;
+    return lseek(fd, st.st_size, SEEK_SET) == st.st_size;
+  }
+  if (ftruncate(fd, 0) == -1) return 0;
+  if (lseek(fd, 0, SEEK_SET) != 0) return 0;
+  return write_all(fd, header, sizeof header);
+}
+
+int jindex_add(const struct jindex_entry* e)
+{
+  unsigned char buf[JINDEX_ENTRY_SIZE];
+  uint32_pack_lsb(e->type, buf);
+  uint32_pack_lsb(e->strnum, buf+4);
+  memcpy(buf+8, e->identhash, JINDEX_HASH_SIZE);
+  uint32_pack_lsb(e->info_offset, buf+16);
+  uint32_pack_lsb(e->info_recnum, buf+20);
+  uint32_pack_lsb(e->end_offset, buf+24);
+  uint32_pack_lsb(e->end_recnum, buf+28);
+  return str_catb(&pending, (char*)buf, sizeof buf);
+}
+
+int jindex_flush(void)
+{
+  int ok;
+  if (fd == -1 || pending.len == 0) return 1;
+  ok = write_all(fd, pending.s, pending.len);
+  pending.len = 0;
+  return ok;
+}
+
+/* Load all the entries from an index, or return 0 if it does not exist
+   or does not match the journal. */
+struct jindex_entry* jindex_load(const char* path, uint32 pagesize,
+				 uint32 first_recnum, unsigned* count)
+{
+  unsigned char header[JINDEX_HEADER_SIZE];
+  unsigned char* buf;
+  unsigned char* p;
+  struct jindex_entry* entries;
+  struct stat st;
+  int ifd;
+  unsigned i;
+  long rd;
+  long len;
+
+  if ((ifd = open(path, O_RDONLY)) == -1) return 0;
+  make_header(header, pagesize, first_recnum);
+  if (fstat(ifd, &st) == -1
+      || st.st_size < JINDEX_HEADER_SIZE
+      || (buf = malloc(st.st_size)) == 0) {
+    close(ifd);
+    return 0;
+  }
+  for (len = 0; len < st.st_size; len += rd)
+    if ((rd = read(ifd, buf+len, st.st_size-len)) <= 0) break;
+  close(ifd);
+  if (len < JINDEX_HEADER_SIZE
+      || memcmp(buf, header, JINDEX_HEADER_SIZE) != 0) {
+    free(buf);
+    return 0;
+  }
+  *count = (len - JINDEX_HEADER_SIZE) / JINDEX_ENTRY_SIZE;
+  if ((entries = malloc((*count+1) * sizeof *entries)) == 0) {
+    free(buf);
+    return 0;
+  }
+  for (i = 0, p = buf+JINDEX_HEADER_SIZE; i < *count;
+       ++i, p += JINDEX_ENTRY_SIZE) {
+    entries[i].type = uint32_get_lsb(p);
+    entries[i].strnum = uint32_get_lsb(p+4);
+    memcpy(entries[i].identhash, p+8, JINDEX_HASH_SIZE);
+    entries[i].info_offset = uint32_get_lsb(p+16);
+    entries[i].info_recnum = uint32_get_lsb(p+20);
+    entries[i].end_offset = uint32_get_lsb(p+24);
+    entries[i].end_recnum = uint32_get_lsb(p+28);
+  }
+  free(buf);
+  return entries;
+}
@@ -0,0 +1,38 @@
+#ifndef JOURNALD__JINDEX__H__
+#define JOURNALD__JINDEX__H__
+
+#include <uint32.h>
+
+#define JINDEX_HEADER_SIZE (8+4+4+4+4)
+#define JINDEX_ENTRY_SIZE (4+4+8+4+4+4+4)
+#define JINDEX_HASH_SIZE 8
+
+#define JINDEX_STREAM 1
+#define JINDEX_TIME 2		/* strnum holds the commit time */
+
+/* Minimum seconds between time marks */
+#define JINDEX_TIME_INTERVAL 1
+
+struct jindex_entry
+{
+  uint32 type;
+  uint32 strnum;
+  unsigned char identhash[JINDEX_HASH_SIZE];
+  uint32 info_offset;
+  uint32 info_recnum;
+  uint32 end_offset;
+  uint32 end_recnum;
+};
+
+extern void jindex_hash(const char* ident, uint32 len,
+			unsigned char hash[JINDEX_HASH_SIZE]);
+
+extern int jindex_open(const char* path, uint32 pagesize,
+		       uint32 first_recnum, int keep);
+extern int jindex_add(const struct jindex_entry* e);
+extern int jindex_flush(void);
+
+extern struct jindex_entry* jindex_load(const char* path, uint32 pagesize,
+					uint32 first_recnum, unsigned* count);
+
+#endif
@@ -25,7 +25,18 @@
 
 const char program[] = "journal-dump";
 const char cli_help_prefix[] = "Dumps the low-level contents of a journal\n";
-const char cli_help_suffix[] = "";
+const char cli_help_suffix[] =
+"\nPatterns are shell wildcards, so 'PREFIX*' selects by prefix.  The\n"
+"data of streams that are not selected is skipped over, unless\n"
+"--check-skipped is given.\n"
+"Times are given as seconds since the epoch, or as a local time in the\n"
+"form 'YYYY-MM-DD [HH:MM:SS]'.\n"
+"With --headers-only, only the record headers and identifiers are read,\n"
+"so the check codes of the other records are not verified.  --follow,\n"
+"--since, and --until always read and check whole transactions.\n"
+"With --follow, a transaction is dumped once it is completely written,\n"
+"which may be before the daemon has synced it.  Give the daemon's\n"
+"--stats file with --stats to wait for the sync.\n";
 const char cli_args_usage[] = "filename";
 const int cli_args_min = 1;
 const int cli_args_max = 1;
@@ -33,6 +44,26 @@ int msg_debug_bits;
 cli_option cli_options[] = {
   { 'd', "debug", CLI_FLAG, DEBUG_JOURNAL, &msg_debug_bits,
     "Turn on some debugging messages", 0 },
+  { 'i', "ident", CLI_STRING, 0, &reader_ident,
+    "Only process streams with identifiers matching PATTERN", 0 },
+  { 0, "ident-file", CLI_STRING, 0, &reader_ident_file,
+    "Only process streams matching one of the patterns in FILE", 0 },
+  { 0, "check-skipped", CLI_FLAG, 1, &reader_check_skipped,
+    "Read and check the data of streams that are not dumped", 0 },
+  { 0, "index", CLI_STRING, 0, &reader_index,
+    "Use the stream index in FILE to find streams by identifier", 0 },
+  { 0, "since", CLI_STRING, 0, &reader_since,
+    "Only dump transactions committed at or after TIME", 0 },
+  { 0, "until", CLI_STRING, 0, &reader_until,
+    "Only dump transactions committed at or before TIME", 0 },
+  { 'f', "follow", CLI_FLAG, 1, &reader_follow,
+    "Keep dumping new transactions as they are committed", 0 },
+  { 0, "stats", CLI_STRING, 0, &reader_stats,
+    "Only follow transactions synced by the daemon with statistics FILE", 0 },
+  { 'H', "headers-only", CLI_FLAG, 1, &reader_headers_only,
+    "Seek over record data instead of reading it", 0 },
+  { 0, "no-check", CLI_FLAG, 1, &reader_no_check,
+    "Do not verify record check codes", 0 },
   {0,0,0,0,0,0,0}
 };
 
@@ -73,3 +104,23 @@ void append_stream(stream* s, const char* buf, uint32 reclen)
   obuf_putu(&outbuf, reclen);
   obuf_putc(&outbuf, LF);
 }
+
+void end_transaction(void)
+{
+  obuf_puts(&outbuf, "commit at ");
+  obuf_putu(&outbuf, reader_trans_time);
+  obuf_putc(&outbuf, LF);
+}
+
+void start_journal(void)
+{
+}
+
+void finish_journal(void)
+{
+}
+
+void idle_journal(void)
+{
+  obuf_flush(&outbuf);
+}
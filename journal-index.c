@@ -0,0 +1,96 @@
+/* journal-index.c - Rebuild the stream index of a journal.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+  
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+  
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <string.h>
+
+#include <cli/cli.h>
+#include <msg/msg.h>
+
+#include "jindex.h"
+#include "reader.h"
+
+const char program[] = "journal-index";
+const char cli_help_prefix[] = "Rebuilds the stream index for a journal\n";
+const char cli_help_suffix[] = "";
+const char cli_args_usage[] = "filename index";
+const int cli_args_min = 2;
+const int cli_args_max = 2;
+int msg_debug_bits;
+cli_option cli_options[] = {
+  { 'd', "debug", CLI_FLAG, DEBUG_JOURNAL, &msg_debug_bits,
+    "Turn on some debugging messages", 0 },
+  {0,0,0,0,0,0,0}
+};
+
+void init_stream(stream* s)
+{
+  s = s;
+}
+
+void append_stream(stream* s, const char* buf, uint32 reclen)
+{
+  s = s;
+  buf = buf;
+  reclen = reclen;
+}
+
+void abort_stream(stream* s)
+{
+  s = s;
+}
+
+void end_stream(stream* s)
+{
+  struct jindex_entry e;
+  e.type = JINDEX_STREAM;
+  e.strnum = s->strnum;
+  jindex_hash(s->ident, s->identlen, e.identhash);
+  e.info_offset = s->info_offset;
+  e.info_recnum = s->info_recnum;
+  e.end_offset = reader_trans_offset;
+  e.end_recnum = reader_trans_recnum;
+  if (!jindex_add(&e)) die1(1, "Out of memory");
+}
+
+void end_transaction(void)
+{
+  static uint32 last_mark = 0;
+  struct jindex_entry e;
+  if (reader_trans_time < last_mark + JINDEX_TIME_INTERVAL) return;
+  last_mark = reader_trans_time;
+  e.type = JINDEX_TIME;
+  e.strnum = reader_trans_time;
+  memset(e.identhash, 0, sizeof e.identhash);
+  e.info_offset = e.end_offset = reader_trans_offset;
+  e.info_recnum = e.end_recnum = reader_trans_recnum;
+  if (!jindex_add(&e)) die1(1, "Out of memory");
+}
+
+void start_journal(void)
+{
+}
+
+void finish_journal(void)
+{
+  if (!jindex_open(reader_argv[0], reader_pagesize, reader_first_recnum, 0)
+      || !jindex_flush())
+    die3sys(1, "Could not write index '", reader_argv[0], "'");
+}
+
+void idle_journal(void)
+{
+}
@@ -15,7 +15,9 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -24,14 +26,43 @@
 
 #include <cli/cli.h>
 #include <msg/msg.h>
+#include <str/str.h>
 
+#include "fdio.h"
 #include "reader.h"
 
 static char** argv = 0;
+static int opt_pipe = 0;
+static unsigned opt_coprocesses = 0;
+static unsigned long opt_memory = 16384;
+
+struct handler
+{
+  int fd;
+  pid_t pid;
+};
+
+#define COPROC_BUFSIZE 65536
+struct coproc
+{
+  int fd;
+  pid_t pid;
+  str buf;
+};
+static struct coproc* coprocs = 0;
 
 const char program[] = "journal-read";
 const char cli_help_prefix[] = "Sends journal streams through a program\n";
-const char cli_help_suffix[] = "";
+const char cli_help_suffix[] =
+"\nPatterns are shell wildcards, so 'PREFIX*' selects by prefix.  The\n"
+"data of streams that are not selected is skipped over, unless\n"
+"--check-skipped is given.  The index is only used when --ident is\n"
+"a plain identifier.\n"
+"Times are given as seconds since the epoch, or as a local time in the\n"
+"form 'YYYY-MM-DD [HH:MM:SS]'.\n"
+"With --follow, a transaction is processed once it is completely\n"
+"written, which may be before the daemon has synced it.  Give the\n"
+"daemon's --stats file with --stats to wait for the sync.\n";
 const char cli_args_usage[] = "filename program [args ...]";
 const int cli_args_min = 2;
 const int cli_args_max = -1;
@@ -39,6 +70,32 @@ int msg_debug_bits;
 cli_option cli_options[] = {
   { 'd', "debug", CLI_FLAG, DEBUG_JOURNAL, &msg_debug_bits,
     "Turn on some debugging messages", 0 },
+  { 'i', "ident", CLI_STRING, 0, &reader_ident,
+    "Only process streams with identifiers matching PATTERN", 0 },
+  { 0, "ident-file", CLI_STRING, 0, &reader_ident_file,
+    "Only process streams matching one of the patterns in FILE", 0 },
+  { 0, "check-skipped", CLI_FLAG, 1, &reader_check_skipped,
+    "Read and check the data of streams that are not processed", 0 },
+  { 0, "index", CLI_STRING, 0, &reader_index,
+    "Use the stream index in FILE to find streams by identifier", 0 },
+  { 'p', "pipe", CLI_FLAG, 1, &opt_pipe,
+    "Start the program at the start of each stream and pipe data to it", 0 },
+  { 'c', "coprocesses", CLI_UINTEGER, 0, &opt_coprocesses,
+    "Send all streams as messages to N persistent copies of the program", 0 },
+  { 'm', "memory", CLI_UINTEGER, 0, &opt_memory,
+    "Buffer up to N kilobytes of stream data in memory", "16384" },
+  { 0, "since", CLI_STRING, 0, &reader_since,
+    "Only process transactions committed at or after TIME", 0 },
+  { 0, "until", CLI_STRING, 0, &reader_until,
+    "Only process transactions committed at or before TIME", 0 },
+  { 0, "state", CLI_STRING, 0, &reader_state,
+    "Continue from where the last run using FILE stopped, and update it", 0 },
+  { 'f', "follow", CLI_FLAG, 1, &reader_follow,
+    "Keep processing new transactions as they are committed", 0 },
+  { 0, "stats", CLI_STRING, 0, &reader_stats,
+    "Only follow transactions synced by the daemon with statistics FILE", 0 },
+  { 0, "poll", CLI_UINTEGER, 0, &reader_poll,
+    "Check for new transactions every N milliseconds when following", "10" },
   {0,0,0,0,0,0,0}
 };
 
@@ -65,52 +122,426 @@ void copy_argv(void)
     argv[i] = reader_argv[i];
 }
 
-void end_stream(stream* s)
+static pid_t spawn(int fd, char* ident, unsigned long offset)
 {
   pid_t pid;
-  int fd;
-  
-  fd = *(int*)(s->data);
-
   if (!argv) copy_argv();
-  if (lseek(fd, 0, SEEK_SET) != 0) die1sys(1, "lseek failed");
   if ((pid = fork()) == -1) die1sys(1, "fork failed");
   if (!pid) {
     close(0);
     dup2(fd, 0);
     close(fd);
-    argv[reader_argc+0] = s->ident;
-    argv[reader_argc+1] = ulongtoa(s->start_offset);
+    argv[reader_argc+0] = ident;
+    argv[reader_argc+1] = ident ? ulongtoa(offset) : 0;
     argv[reader_argc+2] = 0;
+    signal(SIGPIPE, SIG_DFL);
     execvp(argv[0], argv);
     die1sys(1, "exec failed");
   }
+  return pid;
+}
+
+static pid_t start_handler(stream* s, int fd)
+{
+  return spawn(fd, s->ident, s->start_offset);
+}
+
+static void wait_handler(pid_t pid)
+{
   if (waitpid(pid, 0, WUNTRACED) != pid) die1sys(1, "waitpid failed");
-  close(fd);
-  free(s->data);
+}
+
+/* Pipe mode: the handler is started when the stream's info record is
+   seen, and each data record is written to it as it is read. */
+static void pipe_init(stream* s)
+{
+  int fds[2];
+  struct handler* h;
+  if (pipe(fds) == -1) die1sys(1, "pipe failed");
+  /* Keep the other handlers from inheriting this write end, or they
+     would never see EOF on their own pipes. */
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  if ((h = malloc(sizeof *h)) == 0) die1(1, "Out of memory");
+  h->pid = start_handler(s, fds[0]);
+  close(fds[0]);
+  h->fd = fds[1];
+  s->data = h;
+}
+
+static void pipe_append(stream* s, const char* buf, uint32 reclen)
+{
+  struct handler* h;
+  h = s->data;
+  if (h->fd != -1 && !write_all(h->fd, buf, reclen)) {
+    warn2sys("Write to handler failed for ident ", s->ident);
+    close(h->fd);
+    h->fd = -1;
+  }
+}
+
+static void pipe_end(stream* s, int do_abort)
+{
+  struct handler* h;
+  h = s->data;
+  if (do_abort) kill(h->pid, SIGTERM);
+  if (h->fd != -1) close(h->fd);
+  wait_handler(h->pid);
+  free(h);
+}
+
+/* Coprocess mode: a fixed pool of handlers is started once, and every
+   stream is sent to one of them as a series of framed messages (see
+   coprocess.txt).  Streams are assigned to a coprocess by number. */
+static void coproc_flush(struct coproc* c)
+{
+  if (!write_all(c->fd, c->buf.s, c->buf.len))
+    die1sys(1, "Write to coprocess failed");
+  c->buf.len = 0;
+}
+
+static void coproc_finish(void)
+{
+  unsigned i;
+  for (i = 0; i < opt_coprocesses; i++) {
+    coproc_flush(&coprocs[i]);
+    close(coprocs[i].fd);
+  }
+  for (i = 0; i < opt_coprocesses; i++)
+    wait_handler(coprocs[i].pid);
+}
+
+static void coproc_start(void)
+{
+  unsigned i;
+  int fds[2];
+  if ((coprocs = calloc(opt_coprocesses, sizeof *coprocs)) == 0)
+    die1(1, "Out of memory");
+  for (i = 0; i < opt_coprocesses; i++) {
+    if (pipe(fds) == -1) die1sys(1, "pipe failed");
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    coprocs[i].pid = spawn(fds[0], 0, 0);
+    close(fds[0]);
+    coprocs[i].fd = fds[1];
+    if (!str_ready(&coprocs[i].buf, COPROC_BUFSIZE))
+      die1(1, "Out of memory");
+  }
+}
+
+static void coproc_send(stream* s, char type,
+			const char* prefix, uint32 prefixlen,
+			const char* buf, uint32 len)
+{
+  struct coproc* c;
+  unsigned char header[9];
+  if (!coprocs) coproc_start();
+  c = &coprocs[s->strnum % opt_coprocesses];
+  header[0] = type;
+  uint32_pack_msb(s->strnum, header+1);
+  uint32_pack_msb(prefixlen + len, header+5);
+  if (!str_catb(&c->buf, (char*)header, sizeof header) ||
+      !str_catb(&c->buf, prefix, prefixlen))
+    die1(1, "Out of memory");
+  if (c->buf.len + len > COPROC_BUFSIZE) {
+    coproc_flush(c);
+    if (len > COPROC_BUFSIZE) {
+      if (!write_all(c->fd, buf, len))
+	die1sys(1, "Write to coprocess failed");
+      return;
+    }
+  }
+  if (!str_catb(&c->buf, buf, len))
+    die1(1, "Out of memory");
+}
+
+/*
+  Buffered mode: the data of each stream is kept in memory until the
+  stream ends, and is then piped to a newly started handler.  When the
+  total held in memory goes over the --memory budget, the largest
+  buffers are moved to a single shared spill file, each move adding an
+  extent to that stream's list.  Extents freed by finished streams are
+  merged with their free neighbours and reused, and the spill file is
+  truncated whenever it holds no live data.
+*/
+#define SPILL_CHUNK 65536
+
+struct extent
+{
+  off_t offset;
+  off_t len;
+};
+
+struct buffer
+{
+  str mem;
+  struct extent* extents;
+  unsigned extent_count;
+  unsigned extent_size;
+  struct buffer* prev;
+  struct buffer* next;
+};
+
+static struct buffer* buffers = 0;
+static unsigned long buffered = 0;	/* bytes held in memory */
+static int spill_fd = -1;
+static off_t spill_end = 0;
+static off_t spill_live = 0;
+static struct extent* spill_free = 0;
+static unsigned spill_free_count = 0;
+static unsigned spill_free_size = 0;
+
+static int add_extent(struct extent** list, unsigned* count, unsigned* size,
+		      off_t offset, off_t len)
+{
+  if (*count >= *size) {
+    *size = *size ? *size * 2 : 8;
+    if ((*list = realloc(*list, *size * sizeof **list)) == 0) return 0;
+  }
+  (*list)[*count].offset = offset;
+  (*list)[*count].len = len;
+  ++*count;
+  return 1;
+}
+
+/* First fit from the freed extents, or else the end of the file. */
+static off_t spill_alloc(uint32 len)
+{
+  unsigned i;
+  off_t offset;
+  for (i = 0; i < spill_free_count; i++)
+    if (spill_free[i].len >= len) {
+      offset = spill_free[i].offset;
+      spill_free[i].offset += len;
+      if ((spill_free[i].len -= len) == 0)
+	spill_free[i] = spill_free[--spill_free_count];
+      return offset;
+    }
+  offset = spill_end;
+  spill_end += len;
+  return offset;
+}
+
+/* Freed extents are merged with their free neighbours, and space freed
+   at the end of the file is given back to it, so the free list does not
+   fragment while the file is in use. */
+static void spill_release(off_t offset, off_t len)
+{
+  unsigned i;
+  unsigned left = spill_free_count;
+  unsigned right = spill_free_count;
+  for (i = 0; i < spill_free_count; i++) {
+    if (spill_free[i].offset + spill_free[i].len == offset)
+      left = i;
+    else if (offset + len == spill_free[i].offset)
+      right = i;
+  }
+  if (left < spill_free_count) {
+    offset = spill_free[left].offset;
+    len += spill_free[left].len;
+    spill_free[left] = spill_free[--spill_free_count];
+    if (right == spill_free_count) right = left;
+  }
+  if (right < spill_free_count) {
+    len += spill_free[right].len;
+    spill_free[right] = spill_free[--spill_free_count];
+  }
+  if (offset + len == spill_end)
+    spill_end = offset;
+  else if (!add_extent(&spill_free, &spill_free_count, &spill_free_size,
+		       offset, len))
+    die1(1, "Out of memory");
+}
+
+static void spill(struct buffer* b)
+{
+  char filename[] = "journal-read.spill.XXXXXX";
+  off_t offset;
+  if (spill_fd == -1) {
+    if ((spill_fd = mkstemp(filename)) == -1) die1sys(1, "mkstemp failed");
+    if (unlink(filename)) die1sys(1, "unlink failed");
+    fcntl(spill_fd, F_SETFD, FD_CLOEXEC);
+  }
+  offset = spill_alloc(b->mem.len);
+  if (pwrite(spill_fd, b->mem.s, b->mem.len, offset) != (long)b->mem.len)
+    die1sys(1, "write to spill file failed");
+  if (!add_extent(&b->extents, &b->extent_count, &b->extent_size,
+		  offset, b->mem.len))
+    die1(1, "Out of memory");
+  spill_live += b->mem.len;
+  buffered -= b->mem.len;
+  str_free(&b->mem);
+}
+
+static void spill_largest(void)
+{
+  struct buffer* b;
+  struct buffer* largest;
+  for (largest = b = buffers; b != 0; b = b->next)
+    if (b->mem.len > largest->mem.len)
+      largest = b;
+  spill(largest);
+}
+
+static void buffer_init(stream* s)
+{
+  struct buffer* b;
+  if ((b = calloc(1, sizeof *b)) == 0) die1(1, "Out of memory");
+  b->next = buffers;
+  if (buffers) buffers->prev = b;
+  buffers = b;
+  s->data = b;
+}
+
+static void buffer_append(stream* s, const char* buf, uint32 reclen)
+{
+  struct buffer* b = s->data;
+  if (!str_catb(&b->mem, buf, reclen)) die1(1, "Out of memory");
+  buffered += reclen;
+  while (buffered > opt_memory * 1024)
+    spill_largest();
+}
+
+static void buffer_free(struct buffer* b)
+{
+  unsigned i;
+  for (i = 0; i < b->extent_count; i++) {
+    spill_live -= b->extents[i].len;
+    spill_release(b->extents[i].offset, b->extents[i].len);
+  }
+  if (b->extent_count && spill_live == 0) {
+    if (ftruncate(spill_fd, 0) == -1) die1sys(1, "ftruncate failed");
+    spill_end = 0;
+    spill_free_count = 0;
+  }
+  buffered -= b->mem.len;
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    buffers = b->next;
+  if (b->next) b->next->prev = b->prev;
+  str_free(&b->mem);
+  free(b->extents);
+  free(b);
+}
+
+/* The handler may exit without reading all of its input, so a failed
+   write just stops the feeding. */
+static void buffer_feed(stream* s, struct buffer* b, int fd)
+{
+  static char chunk[SPILL_CHUNK];
+  unsigned i;
+  off_t offset;
+  uint32 left;
+  uint32 n;
+  for (i = 0; i < b->extent_count; i++)
+    for (offset = b->extents[i].offset, left = b->extents[i].len;
+	 left > 0; offset += n, left -= n) {
+      n = (left < sizeof chunk) ? left : sizeof chunk;
+      if (pread(spill_fd, chunk, n, offset) != (long)n)
+	die1sys(1, "read from spill file failed");
+      if (!write_all(fd, chunk, n)) {
+	warn2sys("Write to handler failed for ident ", s->ident);
+	return;
+      }
+    }
+  if (!write_all(fd, b->mem.s, b->mem.len))
+    warn2sys("Write to handler failed for ident ", s->ident);
+}
+
+static void buffer_end(stream* s)
+{
+  struct buffer* b = s->data;
+  int fds[2];
+  pid_t pid;
+  if (pipe(fds) == -1) die1sys(1, "pipe failed");
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  pid = start_handler(s, fds[0]);
+  close(fds[0]);
+  buffer_feed(s, b, fds[1]);
+  close(fds[1]);
+  wait_handler(pid);
+  buffer_free(b);
+}
+
+void end_stream(stream* s)
+{
+  if (opt_coprocesses) {
+    coproc_send(s, 'E', 0, 0, 0, 0);
+    return;
+  }
+  if (opt_pipe) {
+    pipe_end(s, 0);
+    return;
+  }
+  buffer_end(s);
 }
 
 void abort_stream(stream* s)
 {
-  int fd;
-  fd = *(int*)(s->data);
-  close(fd);
+  if (opt_coprocesses) {
+    coproc_send(s, 'A', 0, 0, 0, 0);
+    return;
+  }
+  if (opt_pipe) {
+    pipe_end(s, 1);
+    return;
+  }
+  buffer_free(s->data);
+}
+
+/* Handlers are fed through pipes, so one that exits early has to show
+   up as a write error rather than kill the reader.  Each handler gets
+   the default SIGPIPE handling back before it is executed. */
+void start_journal(void)
+{
+  if (opt_pipe && opt_coprocesses)
+    usage(1, "--pipe and --coprocesses can't be used together");
+  signal(SIGPIPE, SIG_IGN);
 }
 
 void init_stream(stream* s)
 {
-  char filename[] = "journal-read.tmp.XXXXXX";
-  int fd;
-  if ((fd = mkstemp(filename)) == -1) die1sys(1, "mkstemp failed");
-  if (unlink(filename)) die1sys(1, "unlink failed");
-  s->data = malloc(sizeof(int));
-  *(int*)(s->data) = fd;
+  unsigned char offset[4];
+  if (opt_coprocesses) {
+    uint32_pack_msb(s->start_offset, offset);
+    coproc_send(s, 'S', (char*)offset, 4, s->ident, s->identlen);
+    return;
+  }
+  if (opt_pipe) {
+    pipe_init(s);
+    return;
+  }
+  buffer_init(s);
 }
 
 void append_stream(stream* s, const char* buf, uint32 reclen)
 {
-  int fd;
-  fd = *(int*)(s->data);
-  if ((uint32)write(fd, buf, reclen) != reclen)
-    die1sys(1, "write to temporary file failed");
+  if (opt_coprocesses) {
+    coproc_send(s, 'D', 0, 0, buf, reclen);
+    return;
+  }
+  if (opt_pipe) {
+    pipe_append(s, buf, reclen);
+    return;
+  }
+  buffer_append(s, buf, reclen);
+}
+
+/* Coprocess messages are buffered, so they are sent before waiting for
+   more transactions. */
+void idle_journal(void)
+{
+  unsigned i;
+  if (coprocs)
+    for (i = 0; i < opt_coprocesses; i++)
+      if (coprocs[i].buf.len)
+	coproc_flush(&coprocs[i]);
+}
+
+void end_transaction(void)
+{
+}
+
+void finish_journal(void)
+{
+  if (coprocs) coproc_finish();
 }
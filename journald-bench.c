@@ -0,0 +1,354 @@
+/* journald-bench.c - Multi-client load generator for journald.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cli/cli.h>
+#include <iobuf/iobuf.h>
+#include <msg/msg.h>
+#include <str/str.h>
+#include <uint64.h>
+
+#include "client.h"
+
+const char program[] = "journald-bench";
+const int msg_show_pid = 0;
+const char cli_help_prefix[] =
+"Measures journald throughput and acknowledgement latency\n";
+const char cli_help_suffix[] =
+"\nIf a journald command line is given, it is started (with the options\n"
+"'-c N -t N -w NAME' inserted) for every combination of the --concurrency,\n"
+"--pause, and --writers lists, and stopped after each run.  Otherwise the\n"
+"daemon listening on the socket is used for a single run.\n";
+const char cli_args_usage[] = "socket [journald-command ...]";
+const int cli_args_min = 1;
+const int cli_args_max = -1;
+
+static unsigned opt_clients = 4;
+static unsigned opt_transactions = 1000;
+static unsigned opt_records = 1;
+static unsigned opt_size = 100;
+static unsigned opt_rate = 0;
+static unsigned opt_priority = JOURNALD_NORMAL;
+static int opt_oneshot = 0;
+static unsigned opt_ring = 0;
+static const char* opt_ident = "bench";
+static const char* opt_concurrency = "10";
+static const char* opt_pause = "10000";
+static const char* opt_writers = "fdatasync";
+cli_option cli_options[] = {
+  { 'n', "clients", CLI_UINTEGER, 0, &opt_clients,
+    "Number of concurrent producers", "4" },
+  { 'T', "transactions", CLI_UINTEGER, 0, &opt_transactions,
+    "Transactions sent by each producer", "1000" },
+  { 'r', "records", CLI_UINTEGER, 0, &opt_records,
+    "Records per transaction", "1" },
+  { 's', "size", CLI_UINTEGER, 0, &opt_size,
+    "Bytes per record", "100" },
+  { 'R', "rate", CLI_UINTEGER, 0, &opt_rate,
+    "Transactions per second per producer (open loop)", "closed loop" },
+  { 'p', "priority", CLI_UINTEGER, 0, &opt_priority,
+    "Priority class (0=normal, 1=urgent, 2=bulk)", "0" },
+  { 'o', "oneshot", CLI_FLAG, 1, &opt_oneshot,
+    "Send each transaction with journald_oneshot (one record)", 0 },
+  { 0, "ring", CLI_UINTEGER, 0, &opt_ring,
+    "Send transactions through a shared memory ring of this many KB",
+    "no ring" },
+  { 'i', "ident", CLI_STRING, 0, &opt_ident,
+    "Stream identifier prefix", "bench" },
+  { 'c', "concurrency", CLI_STRING, 0, &opt_concurrency,
+    "Comma separated list of journald --concurrency values", "10" },
+  { 't', "pause", CLI_STRING, 0, &opt_pause,
+    "Comma separated list of journald --pause values", "10000" },
+  { 'w', "writers", CLI_STRING, 0, &opt_writers,
+    "Comma separated list of journald writer methods", "fdatasync" },
+  {0,0,0,0,0,0,0}
+};
+
+#define FAILED ((uint32)-1)
+
+static const char* socket_path;
+static uint32* latencies;
+static char* payload;
+static journald_ring* ring;
+
+static uint64 now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return (uint64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void sleep_until(uint64 when)
+{
+  uint64 t;
+  while ((t = now()) < when)
+    usleep(when - t);
+}
+
+static int transaction(const char* ident)
+{
+  journald_client* j;
+  unsigned i;
+  uint32 seq;
+  if (ring) {
+    if (!journald_ring_begin(ring, ident)) return 0;
+    for (i = 0; i < opt_records; i++)
+      if (!journald_ring_write(ring, payload, opt_size)) return 0;
+    return (seq = journald_ring_end(ring)) != 0
+      && journald_ring_wait(ring, seq);
+  }
+  if (opt_oneshot)
+    return journald_oneshot(socket_path, ident, payload, opt_size);
+  if ((j = journald_open_priority(socket_path, ident, opt_priority)) == 0)
+    return 0;
+  for (i = 0; i < opt_records; i++)
+    if (!journald_write(j, payload, opt_size)) {
+      close(j->fd);
+      free(j);
+      return 0;
+    }
+  return journald_close(j);
+}
+
+/* In open loop mode, latency is measured from the time the transaction
+   was scheduled, so a stalled daemon is not hidden by the producer
+   falling behind. */
+static void producer(unsigned id)
+{
+  uint32* lat;
+  uint64 start;
+  uint64 sched;
+  uint64 done;
+  unsigned i;
+  str ident = {0,0,0};
+
+  lat = latencies + id * opt_transactions;
+  if (opt_ring
+      && (ring = journald_ring_open(socket_path, opt_ring, opt_priority)) == 0)
+    die1(1, "Could not open a ring");
+  start = now();
+  for (i = 0; i < opt_transactions; i++) {
+    if (opt_rate) {
+      sched = start + (uint64)i * 1000000 / opt_rate;
+      sleep_until(sched);
+    }
+    else
+      sched = now();
+    str_copys(&ident, opt_ident);
+    str_catc(&ident, '.');
+    str_catu(&ident, id);
+    str_catc(&ident, '.');
+    str_catu(&ident, i);
+    if (transaction(ident.s)) {
+      done = now();
+      lat[i] = done - sched;
+    }
+    else
+      lat[i] = FAILED;
+  }
+  _exit(0);
+}
+
+static int cmp_uint32(const void* a, const void* b)
+{
+  uint32 ua = *(const uint32*)a;
+  uint32 ub = *(const uint32*)b;
+  return (ua < ub) ? -1 : (ua > ub);
+}
+
+static void show(const char* name, unsigned long value)
+{
+  obuf_putc(&outbuf, ' ');
+  obuf_puts(&outbuf, name);
+  obuf_putc(&outbuf, '=');
+  obuf_putu(&outbuf, value);
+}
+
+static void report(const char* label, uint64 elapsed)
+{
+  unsigned total;
+  unsigned ok;
+  unsigned i;
+  uint64 bytes;
+
+  total = opt_clients * opt_transactions;
+  qsort(latencies, total, sizeof *latencies, cmp_uint32);
+  for (ok = 0; ok < total && latencies[ok] != FAILED; ok++)
+    ;
+  bytes = (uint64)ok * opt_records * opt_size;
+  if (elapsed == 0) elapsed = 1;
+  obuf_puts(&outbuf, label);
+  show("clients", opt_clients);
+  show("transactions", ok);
+  show("failed", total - ok);
+  show("tps", (uint64)ok * 1000000 / elapsed);
+  show("KBps", bytes * 1000000 / 1024 / elapsed);
+  if (ok) {
+    show("p50", latencies[ok * 500 / 1000]);
+    show("p99", latencies[ok * 990 / 1000]);
+    i = ok * 999 / 1000;
+    show("p999", latencies[i]);
+    show("max", latencies[ok - 1]);
+  }
+  obuf_putc(&outbuf, LF);
+  obuf_flush(&outbuf);
+}
+
+static void run(const char* label)
+{
+  unsigned i;
+  pid_t* pids;
+  uint64 start;
+
+  /* Only the producers are waited for, since a daemon started by
+     run_daemon is also a child of this process. */
+  if ((pids = malloc(opt_clients * sizeof *pids)) == 0)
+    die1(1, "Out of memory");
+  start = now();
+  for (i = 0; i < opt_clients; i++) {
+    if ((pids[i] = fork()) == -1) die1sys(1, "fork failed");
+    if (pids[i] == 0) producer(i);
+  }
+  for (i = 0; i < opt_clients; i++)
+    while (waitpid(pids[i], 0, 0) == -1 && errno == EINTR)
+      ;
+  report(label, now() - start);
+  free(pids);
+}
+
+static void wait_for_daemon(void)
+{
+  int i;
+  journald_client* j;
+  for (i = 0; i < 500; i++) {
+    /* A connection that is closed without an end record is aborted by
+       the daemon, so this does not write anything to the journal. */
+    if ((j = journald_open(socket_path, opt_ident)) != 0) {
+      close(j->fd);
+      free(j);
+      return;
+    }
+    usleep(10000);
+  }
+  die1(1, "journald did not start");
+}
+
+static void run_daemon(char** command, int count,
+		       const char* concurrency, const char* pause,
+		       const char* writer)
+{
+  char** argv;
+  pid_t pid;
+  str label = {0,0,0};
+  int i;
+
+  if ((argv = malloc((count + 8) * sizeof *argv)) == 0)
+    die1(1, "Out of memory");
+  argv[0] = command[0];
+  argv[1] = "-c"; argv[2] = (char*)concurrency;
+  argv[3] = "-t"; argv[4] = (char*)pause;
+  argv[5] = "-w"; argv[6] = (char*)writer;
+  for (i = 1; i < count; i++)
+    argv[i+6] = command[i];
+  argv[count+6] = 0;
+  if ((pid = fork()) == -1) die1sys(1, "fork failed");
+  if (pid == 0) {
+    execvp(argv[0], argv);
+    die1sys(1, "exec failed");
+  }
+  wait_for_daemon();
+  str_copys(&label, "concurrency=");
+  str_cats(&label, concurrency);
+  str_cats(&label, " pause=");
+  str_cats(&label, pause);
+  str_cats(&label, " writer=");
+  str_cats(&label, writer);
+  run(label.s);
+  kill(pid, SIGTERM);
+  waitpid(pid, 0, 0);
+  free(argv);
+  free(label.s);
+}
+
+/* Split a comma separated list into a NUL separated one, returning the
+   number of items. */
+static unsigned split(const char* list, str* out)
+{
+  unsigned count;
+  unsigned i;
+  if (!str_copys(out, list)) die1(1, "Out of memory");
+  for (i = 0, count = 1; i < out->len; i++)
+    if (out->s[i] == ',') {
+      out->s[i] = 0;
+      ++count;
+    }
+  return count;
+}
+
+static const char* item(const str* s, unsigned n)
+{
+  const char* p;
+  for (p = s->s; n > 0; --n)
+    p += strlen(p) + 1;
+  return p;
+}
+
+int cli_main(int argc, char* argv[])
+{
+  str concurrency = {0,0,0};
+  str pause = {0,0,0};
+  str writers = {0,0,0};
+  unsigned nc;
+  unsigned np;
+  unsigned nw;
+  unsigned ic;
+  unsigned ip;
+  unsigned iw;
+
+  socket_path = argv[0];
+  if (opt_clients == 0 || opt_transactions == 0)
+    usage(1, "There must be at least one client and transaction");
+  signal(SIGPIPE, SIG_IGN);
+  latencies = mmap(0, opt_clients * opt_transactions * sizeof *latencies,
+		   PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+  if (latencies == MAP_FAILED) die1sys(1, "Could not allocate memory");
+  if ((payload = malloc(opt_size + 1)) == 0) die1(1, "Out of memory");
+  memset(payload, 'x', opt_size);
+
+  if (argc == 1) {
+    run("");
+    return 0;
+  }
+  nc = split(opt_concurrency, &concurrency);
+  np = split(opt_pause, &pause);
+  nw = split(opt_writers, &writers);
+  for (iw = 0; iw < nw; iw++)
+    for (ic = 0; ic < nc; ic++)
+      for (ip = 0; ip < np; ip++)
+	run_daemon(argv + 1, argc - 1, item(&concurrency, ic),
+		   item(&pause, ip), item(&writers, iw));
+  return 0;
+}
@@ -1,3 +1,4 @@
+#include <string.h>
 #include <unistd.h>
 #include "client.h"
 
@@ -6,9 +7,17 @@ int main(int argc, char* argv[])
   journald_client* j;
   char buf[4096];
   long rd;
+  int priority;
 
-  if (argc != 3) return 1;
-  j = journald_open(argv[1], argv[2]);
+  if (argc == 3)
+    priority = JOURNALD_NORMAL;
+  else if (argc == 4 && strcmp(argv[3], "urgent") == 0)
+    priority = JOURNALD_URGENT;
+  else if (argc == 4 && strcmp(argv[3], "bulk") == 0)
+    priority = JOURNALD_BULK;
+  else
+    return 1;
+  j = journald_open_priority(argv[1], argv[2], priority);
   if (!j) return 2;
   for(;;) {
     rd = read(0, buf, sizeof buf);
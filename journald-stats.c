@@ -0,0 +1,121 @@
+/* journald-stats.c - Display the statistics exported by journald.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+  
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+  
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <sys/types.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cli/cli.h>
+#include <iobuf/iobuf.h>
+#include <msg/msg.h>
+
+#include "stats.h"
+
+const char program[] = "journald-stats";
+const int msg_show_pid = 0;
+const char cli_help_prefix[] = "Displays the statistics exported by journald\n";
+const char cli_help_suffix[] = "";
+const char cli_args_usage[] = "stats-file";
+const int cli_args_min = 1;
+const int cli_args_max = 1;
+static int opt_buckets = 0;
+cli_option cli_options[] = {
+  { 'b', "buckets", CLI_FLAG, 1, &opt_buckets,
+    "Show the full histogram buckets", 0 },
+  {0,0,0,0,0,0,0}
+};
+
+static void show_count(const char* name, uint64 value)
+{
+  obuf_puts(&outbuf, name);
+  obuf_puts(&outbuf, ": ");
+  obuf_putu(&outbuf, value);
+  obuf_putc(&outbuf, LF);
+}
+
+static void show_percentile(const char* name, const struct histogram* h,
+			    unsigned permille)
+{
+  obuf_putc(&outbuf, ' ');
+  obuf_puts(&outbuf, name);
+  obuf_putc(&outbuf, '=');
+  obuf_putu(&outbuf, hist_percentile(h, permille));
+}
+
+static void show_histogram(const char* name, const struct histogram* h)
+{
+  unsigned i;
+  obuf_puts(&outbuf, name);
+  obuf_puts(&outbuf, ": count=");
+  obuf_putu(&outbuf, h->count);
+  obuf_puts(&outbuf, " mean=");
+  obuf_putu(&outbuf, h->count ? h->sum / h->count : 0);
+  show_percentile("p50", h, 500);
+  show_percentile("p90", h, 900);
+  show_percentile("p99", h, 990);
+  show_percentile("p999", h, 999);
+  obuf_puts(&outbuf, " max=");
+  obuf_putu(&outbuf, h->max);
+  obuf_putc(&outbuf, LF);
+  if (opt_buckets)
+    for (i = 0; i < HIST_BUCKETS; i++)
+      if (h->buckets[i]) {
+	obuf_puts(&outbuf, "  >=");
+	obuf_putuw(&outbuf, hist_bucket_min(i), 10, ' ');
+	obuf_puts(&outbuf, ": ");
+	obuf_putu(&outbuf, h->buckets[i]);
+	obuf_putc(&outbuf, LF);
+      }
+}
+
+int cli_main(int argc, char* argv[])
+{
+  int fd;
+  struct stats* s;
+
+  if ((fd = open(argv[0], O_RDONLY)) == -1)
+    die3sys(1, "Could not open '", argv[0], "'");
+  s = mmap(0, sizeof *s, PROT_READ, MAP_SHARED, fd, 0);
+  if (s == MAP_FAILED)
+    die3sys(1, "Could not map '", argv[0], "'");
+  if (memcmp(s->magic, STATS_MAGIC, sizeof s->magic) != 0
+      || s->size != sizeof *s)
+    die3(1, "'", argv[0], "' is not a journald statistics file");
+
+  show_count("uptime (s)", (stats_now() - s->start_time) / 1000000);
+  show_count("page size", s->pagesize);
+  show_count("bytes", s->bytes);
+  show_count("records", s->records);
+  show_count("transactions", s->transactions);
+  show_count("aborts", s->aborts);
+  show_count("commits", s->commits);
+  show_count("failed commits", s->failed_commits);
+  show_count("wraps", s->wraps);
+  show_count("padding bytes", s->padding);
+  show_count("connections", s->connections);
+  show_count("active connections", s->active_connections);
+  show_count("bytes in flight", s->inflight);
+  show_count("idle connections reaped", s->reaped);
+  show_histogram("transactions per commit", &s->commit_size);
+  show_histogram("sync latency (us)", &s->sync_latency);
+  show_histogram("ack latency (us)", &s->ack_latency);
+  obuf_flush(&outbuf);
+  return 0;
+  argc = argc;
+}
@@ -0,0 +1,229 @@
+/* journald-trace.c - Decode a journald event trace.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include <cli/cli.h>
+#include <iobuf/iobuf.h>
+#include <msg/msg.h>
+
+#include "stats.h"
+#include "trace.h"
+
+const char program[] = "journald-trace";
+const int msg_show_pid = 0;
+const char cli_help_prefix[] =
+"Breaks down the latency of each transaction in a journald trace dump\n";
+const char cli_help_suffix[] =
+"\nEach completed transaction is shown with the time (in microseconds)\n"
+"spent in each phase:\n"
+"  ident:  from accepting the connection to reading the identifier\n"
+"  read:   from the identifier to the end of the stream\n"
+"  wait:   from the end of the stream to the start of the commit\n"
+"  sync:   committing the journal\n"
+"  ack:    from the end of the commit to sending the response\n";
+const char cli_args_usage[] = "trace-file";
+const int cli_args_min = 1;
+const int cli_args_max = 1;
+static int opt_summary = 0;
+cli_option cli_options[] = {
+  { 's', "summary", CLI_FLAG, 1, &opt_summary,
+    "Show only the distribution of each phase", 0 },
+  {0,0,0,0,0,0,0}
+};
+
+struct transaction
+{
+  uint32 number;
+  uint64 accept;
+  uint64 ident;
+  uint64 eos;
+  uint32 records;
+  uint64 bytes;
+  int ok;
+};
+
+#define PHASES 6
+static const char* phase_names[PHASES] = {
+  "ident", "read", "wait", "sync", "ack", "total"
+};
+static struct histogram phases[PHASES];
+
+static struct transaction* open_list;
+static unsigned open_count;
+static unsigned open_size;
+static uint64 commit_start;
+static uint64 commit_end;
+
+static struct trace_header header;
+static double usec_per_tick;
+
+static uint64 usec(uint64 ticks)
+{
+  return (uint64)((ticks - header.start_ticks) * usec_per_tick);
+}
+
+static struct transaction* find(uint32 number)
+{
+  unsigned i;
+  for (i = 0; i < open_count; i++)
+    if (open_list[i].number == number)
+      return &open_list[i];
+  return 0;
+}
+
+static struct transaction* add(uint32 number)
+{
+  struct transaction* t;
+  if (open_count >= open_size) {
+    open_size = open_size ? open_size * 2 : 64;
+    if ((open_list = realloc(open_list, open_size * sizeof *t)) == 0)
+      die1(1, "Out of memory");
+  }
+  t = &open_list[open_count++];
+  memset(t, 0, sizeof *t);
+  t->number = number;
+  return t;
+}
+
+static void drop(struct transaction* t)
+{
+  *t = open_list[--open_count];
+}
+
+static void show(const char* name, uint64 value)
+{
+  obuf_putc(&outbuf, ' ');
+  obuf_puts(&outbuf, name);
+  obuf_putc(&outbuf, '=');
+  obuf_putu(&outbuf, value);
+}
+
+/* The commit covering a transaction is the last one that started after
+   its end of stream, which is the one in progress when it is acked. */
+static void finish(struct transaction* t, uint64 ack, int code)
+{
+  uint64 times[PHASES];
+  unsigned i;
+  times[0] = t->ident - t->accept;
+  times[1] = t->eos - t->ident;
+  times[2] = commit_start - t->eos;
+  times[3] = commit_end - commit_start;
+  times[4] = ack - commit_end;
+  times[5] = ack - t->accept;
+  for (i = 0; i < PHASES; i++)
+    hist_add(&phases[i], times[i]);
+  if (opt_summary) return;
+  obuf_putc(&outbuf, '#');
+  obuf_putu(&outbuf, t->number);
+  for (i = 0; i < PHASES; i++)
+    show(phase_names[i], times[i]);
+  show("records", t->records);
+  show("bytes", t->bytes);
+  obuf_puts(&outbuf, code ? " OK" : " failed");
+  obuf_putc(&outbuf, LF);
+}
+
+static void event(const struct trace_event* e)
+{
+  struct transaction* t;
+  uint64 when;
+
+  when = usec(e->time);
+  if (e->type == TRACE_COMMIT_START) {
+    commit_start = when;
+    return;
+  }
+  if (e->type == TRACE_COMMIT_END) {
+    commit_end = when;
+    return;
+  }
+  if (e->type == TRACE_ACCEPT) {
+    if ((t = find(e->number)) != 0) drop(t);
+    add(e->number)->accept = when;
+    return;
+  }
+  /* Events for connections accepted before the start of the trace are
+     ignored, since their breakdown would be incomplete. */
+  if ((t = find(e->number)) == 0) return;
+  switch (e->type) {
+  case TRACE_IDENT:
+    t->ident = when;
+    break;
+  case TRACE_RECORD:
+    ++t->records;
+    t->bytes += e->arg;
+    break;
+  case TRACE_EOS:
+    t->eos = when;
+    t->ok = e->arg;
+    if (!t->ok) drop(t);
+    break;
+  case TRACE_ACK:
+    if (t->eos && commit_end >= t->eos)
+      finish(t, when, e->arg);
+    drop(t);
+    break;
+  }
+}
+
+static void show_phase(unsigned i)
+{
+  const struct histogram* h = &phases[i];
+  obuf_puts(&outbuf, phase_names[i]);
+  show("count", h->count);
+  show("mean", h->count ? h->sum / h->count : 0);
+  show("p50", hist_percentile(h, 500));
+  show("p99", hist_percentile(h, 990));
+  show("p999", hist_percentile(h, 999));
+  show("max", h->max);
+  obuf_putc(&outbuf, LF);
+}
+
+int cli_main(int argc, char* argv[])
+{
+  ibuf in;
+  struct trace_event e;
+  uint32 i;
+
+  if (!ibuf_open(&in, argv[0], 0))
+    die3sys(1, "Could not open '", argv[0], "'");
+  if (!ibuf_read(&in, (char*)&header, sizeof header)
+      || memcmp(header.magic, TRACE_MAGIC, sizeof header.magic) != 0)
+    die3(1, "'", argv[0], "' is not a journald trace file");
+  usec_per_tick = (header.end_ticks > header.start_ticks)
+    ? (double)(header.end_usec - header.start_usec)
+      / (header.end_ticks - header.start_ticks)
+    : 1.0;
+  if (header.dropped) {
+    obuf_puts(&outbuf, "dropped events: ");
+    obuf_putu(&outbuf, header.dropped);
+    obuf_putc(&outbuf, LF);
+  }
+  for (i = 0; i < header.count; i++) {
+    if (!ibuf_read(&in, (char*)&e, sizeof e))
+      die3(1, "'", argv[0], "' is truncated");
+    event(&e);
+  }
+  ibuf_close(&in);
+  for (i = 0; i < PHASES; i++)
+    show_phase(i);
+  obuf_flush(&outbuf);
+  return 0;
+  argc = argc;
+}
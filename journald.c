@@ -19,10 +19,12 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -31,7 +33,10 @@
 #include <msg/msg.h>
 #include <str/str.h>
 
+#include "hash.h"
 #include "server.h"
+#include "stats.h"
+#include "trace.h"
 #include "writer.h"
 
 extern void setup_env(int, const char*);
@@ -43,11 +48,17 @@ extern void setup_env(int, const char*);
 #endif
 
 static unsigned connection_count = 0;
-static unsigned long connection_number = 0;
+static unsigned long inflight = 0;
+static unsigned next_slot = 0;
+static char* dgram_path = 0;
+unsigned long connection_number = 0;
 
 static unsigned long opt_timeout = 10*1000;
+static unsigned long opt_urgent_timeout = 0;
+static unsigned long opt_bulk_timeout = 50*1000;
 static unsigned opt_verbose = 0;
 static unsigned opt_delete = 1;
+static int opt_datagram = 1;
 static const char* opt_socket;
 static uid_t opt_uid = -1;
 static gid_t opt_gid = -1;
@@ -58,8 +69,21 @@ static mode_t opt_mode = 0777;
 const char* opt_mode_str = 0;
 static int opt_backlog = 128;
 static int opt_synconexit = 0;
-static const char* opt_writer = "fdatasync";
+static const char* opt_writer = 0;
+static unsigned long opt_mmap_window = 64;
+static unsigned opt_writeback = 0;
+static const char* opt_check = "crc64";
+static int opt_exclusive = 0;
+static int opt_resume = 0;
+unsigned opt_hint_interval = 64;
+const char* opt_index = 0;
+static const char* opt_stats = 0;
+static const char* opt_trace = 0;
+static unsigned opt_trace_events = 65536;
 unsigned opt_connections = 10;
+static unsigned long opt_read_budget = 16384;
+static unsigned long opt_max_inflight = 0;
+static unsigned long opt_idle_timeout = 0;
 connection* connections;
 
 const char program[] = "journald";
@@ -70,7 +94,12 @@ const char cli_help_suffix[] =
 "  fdatasync:   Uses write and fdatasync to synchronize the data.\n"
 "  mmap:        Uses mmap to access the data, and msync to synchronize.\n"
 "  open+direct: Opens the journal in direct I/O mode (O_DIRECT).\n"
-"  open+sync:   Opens the journal in synchronous write mode (O_DSYNC).\n";
+"  open+sync:   Opens the journal in synchronous write mode (O_DSYNC).\n"
+"  sim:         Simulates a device in memory for repeatable experiments.\n"
+"               Parameters follow as sim:bw=MB/s:lat=us:jitter=us:seed=N,\n"
+"               and crash=N kills the daemon during the Nth sync.\n"
+"The default is open+direct if the journal is a block device, and\n"
+"fdatasync otherwise.\n";
 const char cli_args_usage[] = "socket journal-file";
 const int cli_args_min = 2;
 const int cli_args_max = 2;
@@ -87,12 +116,44 @@ cli_option cli_options[] = {
     "Set umask to MASK (in octal) before creating socket", 0 },
   { 'c', "concurrency", CLI_UINTEGER, 0, &opt_connections,
     "Do not handle more than N simultaneous connections", "10" },
+  { 0, "read-budget", CLI_UINTEGER, 0, &opt_read_budget,
+    "Read at most N bytes from a connection at a time", "16384" },
+  { 0, "max-inflight", CLI_UINTEGER, 0, &opt_max_inflight,
+    "Limit unacknowledged data to about N bytes", "no limit" },
+  { 0, "idle-timeout", CLI_UINTEGER, 0, &opt_idle_timeout,
+    "Abort connections that send nothing for N seconds", "never" },
   { 't', "pause", CLI_UINTEGER, 0, &opt_timeout,
     "Pause synchronization by N us", "10ms" },
+  { 0, "urgent-pause", CLI_UINTEGER, 0, &opt_urgent_timeout,
+    "Pause synchronization of urgent transactions by N us", "0" },
+  { 0, "bulk-pause", CLI_UINTEGER, 0, &opt_bulk_timeout,
+    "Pause synchronization of bulk transactions by N us", "50ms" },
   { 's', "synconexit", CLI_FLAG, 1, &opt_synconexit,
     "Sync on exit/interrupt", 0 },
   { 'w', "writer", CLI_STRING, 0, &opt_writer,
-    "Writer synchronization method", "fdatasync" },
+    "Writer synchronization method", "see below" },
+  { 0, "mmap-window", CLI_UINTEGER, 0, &opt_mmap_window,
+    "Map N megabytes of the journal at a time (0 for all)", "64" },
+  { 0, "writeback", CLI_UINTEGER, 0, &opt_writeback,
+    "Start writing back every N pages as they fill (0 to wait for the sync)",
+    "0" },
+  { 0, "check", CLI_STRING, 0, &opt_check,
+    "Check code algorithm for a new journal (crc64, crc32c, or xxh64)",
+    "crc64" },
+  { 0, "exclusive", CLI_FLAG, 1, &opt_exclusive,
+    "Open a journal device exclusively (fails if it is mounted)", 0 },
+  { 'r', "resume", CLI_FLAG, 1, &opt_resume,
+    "Continue writing after the end of an existing journal", 0 },
+  { 0, "hint-interval", CLI_UINTEGER, 0, &opt_hint_interval,
+    "Update the resume position hint every N commits", "64" },
+  { 0, "index", CLI_STRING, 0, &opt_index,
+    "Maintain an index of completed streams in FILE", 0 },
+  { 0, "stats", CLI_STRING, 0, &opt_stats,
+    "Export statistics through the shared memory FILE", 0 },
+  { 0, "trace", CLI_STRING, 0, &opt_trace,
+    "Trace connection events, dumping them to FILE on SIGUSR1", 0 },
+  { 0, "trace-events", CLI_UINTEGER, 0, &opt_trace_events,
+    "Keep the last N trace events", "65536" },
   { 'q', "quiet", CLI_FLAG, 0, &opt_verbose,
     "Turn off all but error messages", 0 },
   { 'v', "verbose", CLI_FLAG, 1, &opt_verbose,
@@ -101,6 +162,10 @@ cli_option cli_options[] = {
     "Delete the socket on exit", 0 },
   { 0, "no-delete", CLI_FLAG, 0, &opt_delete,
     "Do not delete the socket on exit", 0 },
+  { 0, "datagram", CLI_FLAG, 1, &opt_datagram,
+    "Accept single message transactions on SOCKET.dgram", "on" },
+  { 0, "no-datagram", CLI_FLAG, 0, &opt_datagram,
+    "Do not create the datagram socket", 0 },
   {0,0,0,0,0,0,0}
 };
 
@@ -119,8 +184,17 @@ static void log_status(void)
 
 static void close_connection(connection* con)
 {
-  close(con->fd);
+  if (con->mode != MODE_DATAGRAM)
+    close(con->fd);
+  if (con->pull_fd != -1)
+    close(con->pull_fd);
+  while (con->fd_count > 0)
+    close(con->fds[--con->fd_count]);
   --connection_count;
+  inflight -= con->received;
+  stats->active_connections = connection_count;
+  stats->inflight = inflight;
+  if (!con->ok) ++stats->aborts;
   con->fd = 0;
   if (opt_verbose) {
     str_copys(&msg, "end #");
@@ -139,7 +213,10 @@ static void open_connection(connection* con, int fd)
 {
   memset(con, 0, sizeof(connection));
   con->fd = fd;
+  con->pull_fd = -1;
   con->number = connection_number++;
+  con->last_active = stats_now();
+  trace(TRACE_ACCEPT, con->number, 0);
   if (opt_verbose) {
     str_copys(&msg, "start #");
     str_catu(&msg, con->number);
@@ -151,6 +228,7 @@ void die(const char* s)
 {
   error2sys(s, " failed");
   unlink(opt_socket);
+  if (dgram_path) unlink(dgram_path);
   exit(1);
 }
 
@@ -181,13 +259,24 @@ static void parse_options(char* argv[])
     opt_mode = strtoul(opt_mode_str, &ptr, 8);
     if (*ptr != 0) usage(1, "Invalid mode value");
   }
-  if (opt_timeout >= 1000000) usage(1, "Timeout is too large");
+  if (opt_read_budget == 0) usage(1, "The read budget must not be zero");
   if (opt_envuidgid) {
     use_gid(getenv("GID"));
     use_uid(getenv("UID"));
   }
   opt_socket = argv[0];
+  if (opt_writer == 0)
+    opt_writer = writer_is_device(argv[1]) ? "open+direct" : "fdatasync";
   if (!writer_select(opt_writer)) usage(1, "Invalid writer name");
+  if (!hash_select(opt_check)) usage(1, "Invalid check code algorithm");
+  if (opt_mmap_window >= 4096) usage(1, "The mmap window is too large");
+  writer_mmap_window = opt_mmap_window * 1024 * 1024;
+  if (opt_writeback > WRITER_WRITEBACK_MAX)
+    usage(1, "The writeback interval is too large");
+  writer_writeback = opt_writeback;
+  if (opt_trace_events > TRACE_EVENTS_MAX)
+    usage(1, "Too many trace events");
+  writer_exclusive = opt_exclusive;
 }
 
 static void nonblock(int fd)
@@ -198,32 +287,82 @@ static void nonblock(int fd)
   if (fcntl(fd, F_SETFL, flags) == -1) die("fcntl");
 }
 
-static int make_socket(void)
+static int bind_socket(const char* path, int type)
 {
   struct sockaddr_un* saddr;
   int s;
-  mode_t old_umask;
-  
-  old_umask = umask(opt_umask);
+
   saddr = (struct sockaddr_un*)malloc(sizeof(struct sockaddr_un) +
-				      strlen(opt_socket) + 1);
+				      strlen(path) + 1);
   saddr->sun_family = AF_UNIX;
-  strcpy(saddr->sun_path, opt_socket);
-  unlink(opt_socket);
-  s = socket(AF_UNIX, SOCK_STREAM, 0);
+  strcpy(saddr->sun_path, path);
+  unlink(path);
+  s = socket(AF_UNIX, type, 0);
   if (s < 0) die("socket");
   if (bind(s, (struct sockaddr*)saddr, SUN_LEN(saddr)) != 0) die("bind");
+  free(saddr);
   if (opt_mode_str)
-    if (chmod(opt_socket, opt_mode) != 0) die("chmod");
+    if (chmod(path, opt_mode) != 0) die("chmod");
+  nonblock(s);
+  return s;
+}
+
+/* Creates the stream socket, and the datagram socket next to it (named
+   with a ".dgram" suffix) for single message transactions. */
+static int make_socket(int* dgram)
+{
+  int s;
+  mode_t old_umask;
+  
+  old_umask = umask(opt_umask);
+  s = bind_socket(opt_socket, SOCK_STREAM);
   if (listen(s, opt_backlog) != 0) die("listen");
+  *dgram = -1;
+  if (opt_datagram) {
+    if ((dgram_path = malloc(strlen(opt_socket) + 7)) == 0)
+      die1(1, "Out of memory");
+    strcpy(dgram_path, opt_socket);
+    strcat(dgram_path, ".dgram");
+    *dgram = bind_socket(dgram_path, SOCK_DGRAM);
+  }
   if (opt_gid != (gid_t)-1 && setgid(opt_gid) == -1) die("setgid");
   if (opt_uid != (uid_t)-1 && setuid(opt_uid) == -1) die("setuid");
   umask(old_umask);
-  nonblock(s);
   return s;
 }
 
-static int needs_sync;
+/* The time by which the pending transactions must be committed, or
+   zero if there are none.  Each completed transaction can only move the
+   deadline earlier, so the tightest one among them is honored.  This,
+   like the idle times, is on the monotonic clock of stats_now, so a
+   step of the system clock can't stretch the wait in select. */
+static uint64 sync_deadline;
+
+static void schedule_sync(const connection* con)
+{
+  uint64 deadline;
+  switch (con->priority) {
+  case PRIORITY_URGENT: deadline = con->done_time + opt_urgent_timeout; break;
+  case PRIORITY_BULK: deadline = con->done_time + opt_bulk_timeout; break;
+  default: deadline = con->done_time + opt_timeout;
+  }
+  if (sync_deadline == 0 || deadline < sync_deadline)
+    sync_deadline = deadline;
+}
+
+/* Called when the producer closes its end of a ring connection, or
+   when a commit fails.  A transaction left partly written in the ring
+   is aborted. */
+static void end_ring(connection* con, int ok)
+{
+  int idle;
+  idle = con->state == 0 && con->count == 0;
+  if (!idle)
+    write_record(con, 0, 1);
+  con->ok = ok && idle;
+  ring_stop(con);
+  close_connection(con);
+}
 
 static void do_sync(void) 
 {
@@ -231,40 +370,312 @@ static void do_sync(void)
   connection* last_connection;
   connection* con;
   static char buf[1];
+  unsigned count;
+  uint64 now;
+  static uint32 commit_number;
 
+  sync_deadline = 0;
   last_connection = connections + opt_connections;
+  trace(TRACE_COMMIT_START, TRACE_NOCONN, commit_number);
   ok = sync_records();
+  trace(TRACE_COMMIT_END, TRACE_NOCONN, ok);
+  ++commit_number;
+  now = stats_now();
+  count = 0;
   for (con = connections; con < last_connection; con++) {
-    if (con->fd && con->state == -1) {
+    if (con->fd && con->mode == MODE_RING) {
+      if (con->ring_ended) {
+	ring_complete(con, con->ring_ended, ok);
+	trace(TRACE_ACK, con->number, ok);
+	hist_add(&stats->ack_latency, now - con->done_time);
+	count += con->ring_ended;
+	con->ring_ended = 0;
+	con->received -= con->ring_ended_bytes;
+	inflight -= con->ring_ended_bytes;
+	stats->inflight = inflight;
+	con->ring_ended_bytes = 0;
+	/* The client treats the rest of the session as failed, so no
+	   more is taken from the ring. */
+	if (!ok) end_ring(con, 0);
+      }
+    }
+    else if (con->fd && con->state == -1) {
       buf[0] = con->ok && ok;
-      write(con->fd, buf, 1);
+      if (con->mode == MODE_DATAGRAM)
+	sendto(con->fd, buf, 1, 0, (struct sockaddr*)&con->peer,
+	       con->peer_len);
+      else
+	write(con->fd, buf, 1);
+      trace(TRACE_ACK, con->number, buf[0]);
+      hist_add(&stats->ack_latency, now - con->done_time);
+      ++count;
       close_connection(con);
     }
   }
+  hist_add(&stats->commit_size, count);
+  if (ok) stats->transactions += count;
 }
 
-static void handle_connection(connection* con)
+static void end_connection(connection* con)
 {
-  static char buf[4096];
-  uint32 rd;
-  rd = read(con->fd, buf, sizeof buf);
-  if (!rd || rd == (uint32)-1) {
-    write_record(con, 0, 1);
-    con->state = -1;
-  }
+  con->done_time = stats_now();
+  trace(TRACE_EOS, con->number, con->ok);
+  if (con->ok)
+    if (connection_count == 1)
+      do_sync();
+    else
+      schedule_sync(con);
   else
-    handle_data(con, buf, rd);
-  if(con->state == -1) {
-    if (con->ok)
-      if (connection_count == 1)
-	do_sync();
+    close_connection(con);
+}
+
+/* Reads from a stream connection, queueing any descriptors that were
+   passed with the data.  Passing more descriptors than there is room
+   for is treated as an error. */
+static long read_stream(connection* con, char* buf, uint32 size)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(FDQUEUE * sizeof(int))];
+  } control;
+  long rd;
+  uint32 n;
+
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = buf;
+  iov.iov_len = size;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE((FDQUEUE - con->fd_count) * sizeof(int));
+  if ((rd = recvmsg(con->fd, &msg, 0)) == -1)
+    return -1;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(con->fds + con->fd_count, CMSG_DATA(cmsg), n * sizeof(int));
+      con->fd_count += n;
+    }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    errno = EMFILE;
+    return -1;
+  }
+  return rd;
+}
+
+/* Pulls up to size bytes of a record from its descriptor.  Running
+   short of the range given is an error. */
+static long pull_record(connection* con, uint32 size)
+{
+  long rd;
+  rd = pread(con->pull_fd, con->buf + con->buf_length, size,
+	     con->pull_offset);
+  if (rd == 0) {
+    errno = EIO;
+    return -1;
+  }
+  return rd;
+}
+
+/* Reads up to the read budget from the connection, so that a client
+   with a lot of data queued cannot starve the others.  Record data is
+   read directly into the connection's buffer, saving a copy.  Input
+   that follows a pulled record is held until the pull finishes. */
+static void handle_connection(connection* con)
+{
+  static char buf[READSIZE];
+  unsigned long budget;
+  uint32 direct;
+  uint32 used;
+  long rd;
+  for (budget = opt_read_budget; budget > 0; budget -= rd) {
+    if (con->pending_len && con->state != 6 && con->state != -1) {
+      used = handle_data(con, con->pending + con->pending_pos,
+			 con->pending_len);
+      con->pending_pos += used;
+      con->pending_len -= used;
+      rd = 0;
+      if (con->state == -1 || con->state == 4) break;
+      continue;
+    }
+    if ((direct = direct_space(con)) != 0) {
+      if (direct > budget) direct = budget;
+      if (con->state == 6)
+	rd = pull_record(con, direct);
       else
-	needs_sync = 1;
+	rd = read_stream(con, con->buf + con->buf_length, direct);
+    }
+    else if (con->state == -1)
+      break;
     else
+      rd = read_stream(con, buf, budget < sizeof buf ? budget : sizeof buf);
+    if (rd == -1 && (errno == EAGAIN || errno == EINTR))
+      break;
+    if (rd <= 0) {
+      write_record(con, 0, 1);
+      con->state = -1;
+      break;
+    }
+    con->last_active = stats_now();
+    con->received += rd;
+    inflight += rd;
+    stats->inflight = inflight;
+    if (direct)
+      direct_data(con, rd);
+    else if ((used = handle_data(con, buf, rd)) < rd && con->state == 6) {
+      memcpy(con->pending, buf + used, rd - used);
+      con->pending_pos = 0;
+      con->pending_len = rd - used;
+    }
+    if (con->state == -1 || con->state == 4) break;
+  }
+  if (con->state == 4 && !ring_start(con))
+    con->state = -1;
+  if (con->state == -1)
+    end_connection(con);
+}
+
+/* Resets a ring connection for the next transaction in its ring. */
+static void next_transaction(connection* con)
+{
+  con->state = 0;
+  con->count = 0;
+  con->length = 0;
+  con->ident_len = 0;
+  con->buf_length = 0;
+  con->wrote_ident = 0;
+  con->ok = 0;
+  con->total = 0;
+  con->records = 0;
+  con->number = connection_number++;
+  trace(TRACE_ACCEPT, con->number, 0);
+}
+
+/* Nothing more is sent on the socket of a ring connection, so anything
+   readable there means that the producer has gone away.  Completed
+   transactions are committed with the rest, but are only acknowledged
+   through the ring. */
+static void handle_ring(connection* con, int control, int signalled)
+{
+  static char buf[64];
+  unsigned long budget;
+  uint32 used;
+  long rd;
+
+  if (control) {
+    rd = read(con->fd, buf, sizeof buf);
+    if (rd != -1 || (errno != EAGAIN && errno != EINTR)) {
+      end_ring(con, 1);
+      return;
+    }
+  }
+  for (budget = opt_read_budget; budget > 0; budget -= used) {
+    used = ring_consume(con, budget, signalled);
+    signalled = 0;
+    con->received += used;
+    inflight += used;
+    stats->inflight = inflight;
+    if (con->state != -1) break;
+    con->done_time = stats_now();
+    trace(TRACE_EOS, con->number, con->ok);
+    if (!con->ok) {
+      ring_complete(con, 0, 0);
+      ring_stop(con);
       close_connection(con);
+      return;
+    }
+    ++con->ring_ended;
+    con->ring_ended_bytes = con->received;
+    schedule_sync(con);
+    next_transaction(con);
   }
 }
 
+static void reap_idle(void)
+{
+  connection* con;
+  uint64 timeout;
+  uint64 now;
+  /* The monotonic clock may not have run for a whole timeout yet, so
+     the elapsed time is compared rather than a cutoff. */
+  timeout = (uint64)opt_idle_timeout * 1000000;
+  now = stats_now();
+  for (con = connections; con < connections + opt_connections; ++con)
+    if (con->fd && con->state != -1 && con->mode != MODE_RING
+	&& now >= con->last_active && now - con->last_active >= timeout) {
+      if (opt_verbose) {
+	str_copys(&msg, "idle #");
+	str_catu(&msg, con->number);
+	msg1(msg.s);
+      }
+      ++stats->reaped;
+      write_record(con, 0, 1);
+      con->state = -1;
+      end_connection(con);
+    }
+}
+
+/* A datagram holds a complete transaction in the stream format, with or
+   without the final zero length.  It takes a connection slot only until
+   it has been committed and acknowledged to the sender. */
+static int receive_datagram(int d)
+{
+  static char buf[DGRAM_MAX];
+  static char nak[1] = { 0 };
+  connection* con;
+  struct sockaddr_un peer;
+  socklen_t peer_len;
+  long rd;
+
+  peer_len = sizeof peer;
+  rd = recvfrom(d, buf, sizeof buf, MSG_TRUNC,
+		(struct sockaddr*)&peer, &peer_len);
+  if (rd == -1) return 0;
+  for (con = connections; con->fd; ++con)
+    ;
+  ++connection_count;
+  ++stats->connections;
+  stats->active_connections = connection_count;
+  log_status();
+  open_connection(con, d);
+  con->mode = MODE_DATAGRAM;
+  memcpy(&con->peer, &peer, peer_len);
+  con->peer_len = peer_len;
+  if (rd <= (long)sizeof buf) {
+    con->received = rd;
+    inflight += rd;
+    stats->inflight = inflight;
+    handle_data(con, buf, rd);
+    if (con->state == 2 && con->count == 0) {
+      con->ok = write_record(con, 1, 0);
+      con->state = -1;
+    }
+    else if (con->state != -1) {
+      write_record(con, 0, 1);
+      con->state = -1;
+    }
+  }
+  else
+    con->state = -1;
+  if (!con->ok)
+    sendto(d, nak, 1, 0, (struct sockaddr*)&peer, peer_len);
+  end_connection(con);
+  return 1;
+}
+
+/* When the unacknowledged data is over the limit, connections holding
+   more than their share of it are not read until commits release some,
+   unless no connection is under its share. */
+static int over_share(const connection* con)
+{
+  return opt_max_inflight
+    && inflight >= opt_max_inflight
+    && con->received >= opt_max_inflight / connection_count;
+}
+
 static void accept_connection(int s)
 {
   int fd;
@@ -277,6 +688,8 @@ static void accept_connection(int s)
   } while(fd < 0);
   nonblock(fd);
   ++connection_count;
+  ++stats->connections;
+  stats->active_connections = connection_count;
   log_status();
 
   for (i = 0; i < opt_connections; i++) {
@@ -287,90 +700,166 @@ static void accept_connection(int s)
   }
 }
 
-static void do_select(int s)
+static void dump_trace(void)
+{
+  trace_dump_requested = 0;
+  if (!trace_dump(opt_trace))
+    warn3sys("Could not write the trace file '", opt_trace, "'");
+}
+
+static void request_trace_dump()
+{
+  trace_dump_requested = 1;
+}
+
+static void do_select(int s, int d)
 {
   static fd_set rfds;
   int fdmax;
   int fd;
   unsigned i;
-  static struct timeval timeout = {0,0};
-  static struct timeval sync_time;
+  unsigned reading;
+  unsigned eligible;
+  int busy;
+  connection* con;
+  struct timeval timeout;
   struct timeval* timeptr;
-
-  /* If a sync point is needed, determine the end time when the sync
-     will actually happen. */
-  if (needs_sync) {
-    timeptr = &timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = opt_timeout;
-    if (sync_time.tv_sec == 0) {
-      gettimeofday(&sync_time, 0);
-      sync_time.tv_usec += opt_timeout;
-      if (sync_time.tv_usec >= 1000000) {
-	sync_time.tv_usec -= 1000000;
-	sync_time.tv_sec--;
-      }
-    }
-  }
-  else
-    timeptr = 0;
+  uint64 deadline;
+  uint64 now;
 
   fdmax = -1;
   FD_ZERO(&rfds);
-  if (connection_count < opt_connections) {
+  if (connection_count < opt_connections
+      && (opt_max_inflight == 0 || inflight < opt_max_inflight)) {
     FD_SET(s, &rfds);
     fdmax = s;
-  }
-  for (i = 0; i < opt_connections; i++) {
-    fd = connections[i].fd;
-    if (fd) {
-      FD_SET(fd, &rfds);
-      if (fd > fdmax) fdmax = fd;
+    if (d != -1) {
+      FD_SET(d, &rfds);
+      if (d > fdmax) fdmax = d;
     }
   }
-  while ((fd = select(fdmax+1, &rfds, 0, 0, timeptr)) == -1) {
-    if (errno != EINTR) die("select");
-    if (needs_sync) timeout.tv_usec = opt_timeout;
-  }
-  if (needs_sync) {
-    /* Do the sync if the select either timed out, or if the end time
-       has been passed. */
-    if (!fd) {
-      do_sync();
-      needs_sync = sync_time.tv_sec = sync_time.tv_usec = 0;
-    }
-    else {
-      gettimeofday(&timeout, 0);
-      if (timeout.tv_sec > sync_time.tv_sec ||
-	  timeout.tv_usec > sync_time.tv_usec) {
-	do_sync();
-	needs_sync = sync_time.tv_sec = sync_time.tv_usec = 0;
+  /* Connections that have completed their transaction are only waiting
+     for the commit, so they are not read. */
+  deadline = sync_deadline;
+  reading = eligible = busy = 0;
+  for (con = connections; con < connections + opt_connections; ++con) {
+    if (!con->fd || con->state == -1) continue;
+    ++reading;
+    /* A ring with data waiting keeps select from sleeping, unless it
+       is held back like any other connection. */
+    if (con->mode == MODE_RING) {
+      if (over_share(con)) {
+	FD_SET(con->fd, &rfds);
+	if (con->fd > fdmax) fdmax = con->fd;
+	continue;
       }
+      ++eligible;
+      FD_SET(con->fd, &rfds);
+      FD_SET(ring_fd(con), &rfds);
+      if (con->fd > fdmax) fdmax = con->fd;
+      if (ring_fd(con) > fdmax) fdmax = ring_fd(con);
+      if (ring_ready(con)) busy = 1;
+      continue;
+    }
+    if (opt_idle_timeout) {
+      now = con->last_active + (uint64)opt_idle_timeout * 1000000;
+      if (deadline == 0 || now < deadline) deadline = now;
     }
+    /* A connection held back here is not idle on its own account. */
+    if (over_share(con)) {
+      con->last_active = stats_now();
+      continue;
+    }
+    /* Pulling a record, or input held back by one, does not wait for
+       the socket. */
+    if (con->state == 6 || con->pending_len) busy = 1;
+    ++eligible;
+    FD_SET(con->fd, &rfds);
+    if (con->fd > fdmax) fdmax = con->fd;
+  }
+  if (reading && !eligible)
+    for (con = connections; con < connections + opt_connections; ++con)
+      if (con->fd && con->state != -1) {
+	FD_SET(con->fd, &rfds);
+	if (con->fd > fdmax) fdmax = con->fd;
+	if (con->mode == MODE_RING) {
+	  FD_SET(ring_fd(con), &rfds);
+	  if (ring_fd(con) > fdmax) fdmax = ring_fd(con);
+	  if (ring_ready(con)) busy = 1;
+	}
+      }
+
+  /* If a sync point or idle check is needed, wait no later than its
+     deadline. */
+  if (busy) {
+    timeout.tv_sec = timeout.tv_usec = 0;
+    timeptr = &timeout;
+  }
+  else if (deadline) {
+    now = stats_now();
+    now = (deadline > now) ? deadline - now : 0;
+    timeout.tv_sec = now / 1000000;
+    timeout.tv_usec = now % 1000000;
+    timeptr = &timeout;
   }
+  else
+    timeptr = 0;
+
+  if ((fd = select(fdmax+1, &rfds, 0, 0, timeptr)) == -1 && errno != EINTR)
+    die("select");
+  /* The signal may have arrived while select was not waiting, so the
+     request is checked on every pass. */
+  if (trace_dump_requested) dump_trace();
+  if (fd == -1) return;
   if (fd) {
     if (FD_ISSET(s, &rfds))
       accept_connection(s);
-    for (i = 0; i < opt_connections; i++) {
-      fd = connections[i].fd;
-      if (FD_ISSET(connections[i].fd, &rfds))
-	handle_connection(connections+i);
+    if (d != -1 && FD_ISSET(d, &rfds))
+      while (connection_count < opt_connections && receive_datagram(d))
+	;
+  }
+  /* Start at a different slot on each pass, so the low slots do not
+     always get the first share of the commit. */
+  for (i = 0; i < opt_connections; i++) {
+    con = connections + (next_slot + i) % opt_connections;
+    if (!con->fd || con->state == -1) continue;
+    if (con->mode == MODE_RING) {
+      if (FD_ISSET(con->fd, &rfds)
+	  || ((FD_ISSET(ring_fd(con), &rfds) || ring_ready(con))
+	      && (!eligible || !over_share(con))))
+	handle_ring(con, FD_ISSET(con->fd, &rfds),
+		    FD_ISSET(ring_fd(con), &rfds));
     }
+    else if (FD_ISSET(con->fd, &rfds)
+	     || ((con->state == 6 || con->pending_len) && !over_share(con)))
+      handle_connection(con);
   }
+  next_slot = (next_slot + 1) % opt_connections;
+  if (opt_idle_timeout)
+    reap_idle();
+  /* The sync is done after reading, so that an urgent transaction
+     completed above is committed without another pass. */
+  if (sync_deadline && stats_now() >= sync_deadline)
+    do_sync();
 }
 
 static void handle_intr()
 {
+  if (opt_trace)
+    dump_trace();
   if (opt_synconexit)
     rotate_journal();
-  if (opt_delete)
+  if (opt_delete) {
     unlink(opt_socket);
+    if (dgram_path) unlink(dgram_path);
+  }
   exit(0);
 }
 
 int cli_main(int argc, char* argv[])
 {
   int s;
+  int d;
 
   parse_options(argv);
   if ((connections = malloc(sizeof(connection) * opt_connections)) == 0)
@@ -381,11 +870,21 @@ int cli_main(int argc, char* argv[])
   signal(SIGHUP, SIG_IGN);
   signal(SIGPIPE, SIG_IGN);
   signal(SIGALRM, SIG_IGN);
-  s = make_socket();
-  if (!open_journal(argv[1]))
+  s = make_socket(&d);
+  if (opt_stats && !stats_open(opt_stats))
+    die3sys(1, "Could not open the statistics file '", opt_stats, "'");
+  if (opt_trace) {
+    if (!trace_init(opt_trace_events)) die1(1, "Out of memory");
+    signal(SIGUSR1, request_trace_dump);
+  }
+  switch (open_journal(argv[1], opt_resume)) {
+  case 0:
     die3sys(1, "Could not open the journal file '", argv[1], "'");
+  case -1:
+    die3(1, "Could not resume the journal file '", argv[1], "'");
+  }
   log_status();
   for(;;)
-    do_select(s);
+    do_select(s, d);
   argc = argc;
 }
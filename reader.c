@@ -15,12 +15,22 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include <cli/cli.h>
 #include <iobuf/iobuf.h>
@@ -29,16 +39,128 @@
 
 #include "flags.h"
 #include "hash.h"
+#include "jindex.h"
 #include "reader.h"
+#include "stats.h"
 
 const int msg_show_pid = 0;
 
 int reader_argc;
 char** reader_argv;
+const char* reader_index = 0;
+const char* reader_ident = 0;
+const char* reader_ident_file = 0;
+int reader_follow = 0;
+unsigned reader_poll = 10;
+const char* reader_since = 0;
+const char* reader_until = 0;
+const char* reader_state = 0;
+const char* reader_stats = 0;
+int reader_headers_only = 0;
+int reader_no_check = 0;
+int reader_check_skipped = 0;
+
+uint32 reader_pagesize;
+uint32 reader_first_recnum;
+uint32 reader_trans_offset;
+uint32 reader_trans_recnum;
+uint32 reader_trans_time;
 
 static stream* streams;
-static uint32 pagesize;
 static uint32 global_recnum;
+static uint32 version;
+
+/* When reading through an index, only these streams are wanted. */
+static uint32* wanted = 0;
+static unsigned wanted_count = 0;
+
+/* Set when reading starts part way through the journal, so records for
+   streams that started earlier are expected. */
+static int skipping = 0;
+
+/* Returns true if record number a comes before b. */
+static int recnum_before(uint32 a, uint32 b)
+{
+  return a != b && b - a < 0x80000000UL;
+}
+
+/* Stream identifiers are matched against shell wildcard patterns, from
+   --ident and from the lines of --ident-file.  They are kept in one
+   string, separated by NULs. */
+static str patterns;
+static unsigned pattern_count = 0;
+
+static void add_pattern(const char* p, unsigned len)
+{
+  if (!str_catb(&patterns, p, len) || !str_catc(&patterns, 0))
+    die1(1, "Out of memory");
+  ++pattern_count;
+}
+
+static void load_patterns(void)
+{
+  ibuf in;
+  str line = {0,0,0};
+  if (reader_ident)
+    add_pattern(reader_ident, strlen(reader_ident));
+  if (reader_ident_file) {
+    if (!ibuf_open(&in, reader_ident_file, 0))
+      die3sys(1, "Could not open '", reader_ident_file, "'");
+    while (ibuf_getstr(&in, &line, LF)) {
+      str_rstrip(&line);
+      if (line.len) add_pattern(line.s, line.len);
+    }
+    if (!ibuf_eof(&in))
+      die3sys(1, "Could not read '", reader_ident_file, "'");
+    ibuf_close(&in);
+    str_free(&line);
+    if (pattern_count == 0)
+      die3(1, "'", reader_ident_file, "' contains no identifiers");
+  }
+}
+
+/* The index can only find streams by an exact identifier. */
+static int literal_ident(void)
+{
+  return reader_ident && !reader_ident_file
+    && strpbrk(reader_ident, "*?[\\") == 0;
+}
+
+static int want_stream(uint32 strnum, const char* id)
+{
+  const char* p;
+  unsigned i;
+  if (pattern_count) {
+    for (p = patterns.s, i = 0; i < pattern_count; p += strlen(p) + 1, i++)
+      if (fnmatch(p, id, 0) == 0)
+	break;
+    if (i == pattern_count) return 0;
+  }
+  if (!wanted) return 1;
+  for (i = 0; i < wanted_count; i++)
+    if (wanted[i] == strnum)
+      return 1;
+  return 0;
+}
+
+/* Set from the --state file when it matches the journal: the global
+   record number reached by the previous run, and the streams that were
+   still open then.  Any other stream starting before that record has
+   already been dispatched. */
+static int state_loaded = 0;
+static uint32 state_done;
+static uint32* state_open = 0;
+static unsigned state_open_count = 0;
+
+static int dispatched(uint32 strnum)
+{
+  unsigned i;
+  if (!state_loaded || !recnum_before(global_recnum, state_done)) return 0;
+  for (i = 0; i < state_open_count; i++)
+    if (state_open[i] == strnum)
+      return 0;
+  return 1;
+}
 
 static stream* new_stream(uint32 strnum, uint32 recnum,
 			  uint32 offset, char* id, uint32 idlen)
@@ -52,9 +174,13 @@ static stream* new_stream(uint32 strnum, uint32 recnum,
   n->ident = malloc(idlen+1);
   memcpy(n->ident, id, idlen);
   n->ident[idlen] = 0;
+  n->info_offset = reader_trans_offset;
+  n->info_recnum = reader_trans_recnum;
+  n->ignored = !want_stream(strnum, n->ident) || dispatched(strnum);
   n->next = streams;
   streams = n;
-  init_stream(n);
+  if (!n->ignored)
+    init_stream(n);
   return n;
 }
 
@@ -105,7 +231,7 @@ static void handle_record(uint32 typeflags, uint32 strnum,
     str_copyu(&soffset, h->offset);
     if (recnum != h->recnum) {
       warn3("Bad record number for stream #", sstrnum.s, ", dropping stream");
-      abort_stream(h);
+      if (!h->ignored) abort_stream(h);
       del_stream(h);
       return;
     }
@@ -133,30 +259,55 @@ static void handle_record(uint32 typeflags, uint32 strnum,
       if (h) {
 	debug6(DEBUG_JOURNAL, "Append stream #", sstrnum.s,
 	       " record ", srecnum.s, " offset ", soffset.s);
-	append_stream(h, buf, reclen);
+	if (!h->ignored) append_stream(h, buf, reclen);
 	h->offset += reclen;
 	h->recnum ++;
       }
-      else
+      else if (!skipping)
 	warn2("Data record for nonexistant stream #", sstrnum.s);
     }
     if (typeflags & RECORD_EOS) {
       if (h) {
 	debug6(DEBUG_JOURNAL, "End stream #", sstrnum.s,
 	       " at record ", srecnum.s, " offset ", soffset.s);
-	end_stream(h);
+	if (!h->ignored) end_stream(h);
 	del_stream(h);
       }
-      else
+      else if (!skipping)
 	warn2("End record for nonexistant stream #", sstrnum.s);
     }
   }
 }
 
+/* Returns true if the check code following the record data matches. */
+static int check_record(const unsigned char* header,
+			const char* data, uint32 reclen)
+{
+  char hcmp[HASH_SIZE];
+  HASH_CTX hash;
+  hash_init(&hash);
+  hash_update(&hash, header, HEADER_SIZE);
+  hash_update(&hash, data, reclen);
+  hash_finish(&hash, hcmp);
+  return memcmp(data+reclen, hcmp, HASH_SIZE) == 0;
+}
+
+/* Seeking over a record means its check code, which also covers the
+   header, can't be verified.  So apart from --headers-only, only the
+   data of streams that the patterns exclude is skipped.  Records that
+   end a stream, and empty ones, cost nothing extra to check. */
+static int need_data(uint32 typeflags, uint32 strnum, uint32 reclen)
+{
+  stream* h;
+  if (typeflags & RECORD_INFO) return 1;
+  if (reader_headers_only) return 0;
+  if (reader_check_skipped || pattern_count == 0) return 1;
+  if (reclen == 0 || (typeflags & (RECORD_EOS|RECORD_ABORT))) return 1;
+  return (h = find_stream(strnum)) == 0 || !h->ignored;
+}
+
 static int read_record(unsigned char header[HEADER_SIZE], ibuf* in)
 {
-  static char hcmp[HASH_SIZE];
-  static HASH_CTX hash;
   uint32 strnum;
   uint32 recnum;
   uint32 grecnum;
@@ -173,14 +324,17 @@ static int read_record(unsigned char header[HEADER_SIZE], ibuf* in)
   strnum = uint32_get_lsb(hdrptr); hdrptr += 4;
   recnum = uint32_get_lsb(hdrptr); hdrptr += 4;
   reclen = uint32_get_lsb(hdrptr);
+  if (!need_data(typeflags, strnum, reclen)) {
+    if (!ibuf_seek(in, ibuf_tell(in) + reclen + HASH_SIZE))
+      die1sys(1, "Could not skip record data.");
+    handle_record(typeflags, strnum, recnum, reclen, 0);
+    global_recnum++;
+    return 1;
+  }
   str_ready(&buf, reclen+HASH_SIZE);
   if (!ibuf_read(in, buf.s, reclen+HASH_SIZE))
     die1sys(1, "Could not read record data.");
-  hash_init(&hash);
-  hash_update(&hash, header, HEADER_SIZE);
-  hash_update(&hash, buf.s, reclen);
-  hash_finish(&hash, hcmp);
-  if (memcmp(buf.s+reclen, hcmp, HASH_SIZE))
+  if (!reader_no_check && !check_record(header, buf.s, reclen))
     die1(1, "Record data was corrupted (check code mismatch).");
 
   handle_record(typeflags, strnum, recnum, reclen, buf.s);
@@ -192,59 +346,647 @@ static int skip_page(ibuf* in)
 {
   uint32 pos;
   pos = ibuf_tell(in);
-  return ibuf_seek(in, pos + (pagesize - pos%pagesize));
+  if (pos % reader_pagesize == 0) return 1;
+  return ibuf_seek(in, pos + (reader_pagesize - pos%reader_pagesize));
+}
+
+/* Version 3 journals end each transaction with a checked record. */
+static void read_eot(unsigned char header[HEADER_SIZE], ibuf* in)
+{
+  static str buf;
+  uint32 reclen;
+
+  reader_trans_time = 0;
+  if (version < 3) return;
+  reader_trans_time = uint32_get_lsb(header+12);
+  if (uint32_get_lsb(header+4) != global_recnum)
+    die1(1, "Global record number mismatch at end of transaction.");
+  reclen = uint32_get_lsb(header+16);
+  str_ready(&buf, reclen+HASH_SIZE);
+  if (!ibuf_read(in, buf.s, reclen+HASH_SIZE))
+    die1sys(1, "Could not read end of transaction record.");
+  if (!reader_no_check && !check_record(header, buf.s, reclen))
+    die1(1, "End of transaction was corrupted (check code mismatch).");
 }
 
 static int read_transaction(ibuf* in)
 {
   unsigned char header[HEADER_SIZE];
+  reader_trans_offset = ibuf_tell(in);
+  reader_trans_recnum = global_recnum;
   if (!ibuf_read(in, header, HEADER_SIZE)) return 0;
   if (uint32_get_lsb(header) == 0) return 0;
   do {
     if (!read_record(header, in)) return 0;
     if (!ibuf_read(in, header, HEADER_SIZE)) return 0;
   } while (uint32_get_lsb(header) != 0);
+  read_eot(header, in);
+  end_transaction();
   return skip_page(in);
 }
 
-void read_journal(const char* filename)
+/* Ignored streams that are still open at the end of an indexed range
+   will never be completed. */
+static void drop_ignored(void)
 {
   stream* h;
-  char header[8+4+4+4+4+HASH_SIZE];
+  stream* next;
+  for (h = streams; h != 0; h = next) {
+    next = h->next;
+    if (h->ignored)
+      del_stream(h);
+  }
+}
+
+static int cmp_info_offset(const void* a, const void* b)
+{
+  const struct jindex_entry* ea = a;
+  const struct jindex_entry* eb = b;
+  return (ea->info_offset < eb->info_offset) ? -1
+    : (ea->info_offset > eb->info_offset);
+}
+
+/* Use the index to read only the transactions that contain the wanted
+   streams, from the one holding the info record up to the one holding
+   the end record.  Overlapping ranges are merged. */
+static int read_indexed(ibuf* in)
+{
+  struct jindex_entry* entries;
+  unsigned char hash[JINDEX_HASH_SIZE];
+  unsigned count;
+  unsigned i;
+  unsigned j;
+  uint32 end;
+
+  if ((entries = jindex_load(reader_index, reader_pagesize,
+			     reader_first_recnum, &count)) == 0) {
+    warn3("Index '", reader_index, "' is missing or out of date, ignoring it");
+    return 0;
+  }
+  jindex_hash(reader_ident, strlen(reader_ident), hash);
+  for (i = j = 0; i < count; i++)
+    if (entries[i].type == JINDEX_STREAM
+	&& memcmp(entries[i].identhash, hash, JINDEX_HASH_SIZE) == 0)
+      entries[j++] = entries[i];
+  count = j;
+  if ((wanted = malloc((count+1) * sizeof *wanted)) == 0)
+    die1(1, "Out of memory");
+  for (i = 0; i < count; i++)
+    wanted[i] = entries[i].strnum;
+  wanted_count = count;
+  skipping = 1;
+  qsort(entries, count, sizeof *entries, cmp_info_offset);
+
+  for (i = 0; i < count; i = j) {
+    end = entries[i].end_offset;
+    for (j = i + 1; j < count && entries[j].info_offset <= end; j++)
+      if (entries[j].end_offset > end)
+	end = entries[j].end_offset;
+    if (!ibuf_seek(in, entries[i].info_offset))
+      die1sys(1, "Could not seek to indexed stream");
+    global_recnum = entries[i].info_recnum;
+    while (ibuf_tell(in) <= end && read_transaction(in))
+      ;
+    drop_ignored();
+  }
+  free(entries);
+  return 1;
+}
+
+/*
+  Follow mode reads transactions with pread, since a buffered reader
+  would keep returning the data it read before the journal changed.
+  A transaction is only processed once all of its records, up to its
+  end of transaction record, have been read and checked, so a
+  transaction that is still being written is simply retried later.
+
+  A transaction is complete in the page cache before the daemon's sync
+  has finished, and may yet fail to commit or be lost in a crash.  When
+  the daemon's statistics file is given, a transaction is held back
+  until the record number the daemon last synced has reached its end.
+
+  The writer always leaves an end of transaction marker at the start of
+  the page where the next transaction will go.  When the journal wraps,
+  the first record number in the file header is changed to the number
+  following the last transaction before the wrap, and writing restarts
+  on the second page.  So when the reader is sitting on a marker that
+  carries the record number in the header, it continues at the second
+  page.  If the header has moved past the reader's record number and
+  there is no transaction to read, the writer has overwritten data that
+  was not read yet, and the reader starts over at the second page.
+*/
+
+static volatile int follow_stopped = 0;
+
+static void stop_following()
+{
+  follow_stopped = 1;
+}
+
+static int read_at(int fd, uint32 offset, void* buf, uint32 len)
+{
+  return pread(fd, buf, len, offset) == (long)len;
+}
+
+/* Returns true if a is a later record number than b. */
+static int recnum_after(uint32 a, uint32 b)
+{
+  return a != b && a - b < 0x80000000UL;
+}
+
+/* The file header's check code is always CRC64, and covers the header
+   options. */
+static int check_file_header(const char* header)
+{
   char hashbuf[HASH_SIZE];
   HASH_CTX hash;
+  uint32 len;
+  if ((len = uint32_get_lsb(header+20)) > FILE_OPTIONS_MAX) return 0;
+  len += FILE_HEADER_SIZE - HASH_SIZE;
+  hash_init_type(&hash, HASH_CRC64);
+  hash_update(&hash, header, len);
+  hash_finish(&hash, hashbuf);
+  return memcmp(header + len, hashbuf, HASH_SIZE) == 0;
+}
+
+static int reread_first_recnum(int fd, uint32* first)
+{
+  char header[FILE_HEADER_SIZE+FILE_OPTIONS_MAX];
+  if (!read_at(fd, 0, header, sizeof header)) return 0;
+  if (!check_file_header(header)) return 0;
+  *first = uint32_get_lsb(header+16);
+  return 1;
+}
+
+/* Reads the records of the transaction at offset into buf.  Returns
+   false if there is no complete transaction there. */
+static int load_transaction(int fd, uint32 offset, str* buf)
+{
+  unsigned char* header;
+  uint32 recnum;
+  uint32 reclen;
+
+  buf->len = 0;
+  for (recnum = global_recnum; ; ++recnum) {
+    if (!str_ready(buf, buf->len + HEADER_SIZE)) die1(1, "Out of memory");
+    header = (unsigned char*)buf->s + buf->len;
+    if (!read_at(fd, offset + buf->len, header, HEADER_SIZE)) return 0;
+    if (uint32_get_lsb(header+4) != recnum) return 0;
+    if (uint32_get_lsb(header) == RECORD_EOT && buf->len == 0) return 0;
+    /* A header that is still being written may hold any length. */
+    if ((reclen = uint32_get_lsb(header+16)) > 0x1000000) return 0;
+    if (!str_ready(buf, buf->len + HEADER_SIZE + reclen + HASH_SIZE))
+      die1(1, "Out of memory");
+    header = (unsigned char*)buf->s + buf->len;
+    if (!read_at(fd, offset + buf->len + HEADER_SIZE,
+		 header + HEADER_SIZE, reclen + HASH_SIZE))
+      return 0;
+    if (!check_record(header, (char*)header + HEADER_SIZE, reclen))
+      return 0;
+    buf->len += HEADER_SIZE + reclen + HASH_SIZE;
+    if (uint32_get_lsb(header) == RECORD_EOT) return 1;
+  }
+}
+
+static void process_transaction(uint32 offset, const str* buf)
+{
+  const unsigned char* p;
+  uint32 reclen;
+  reader_trans_offset = offset;
+  reader_trans_recnum = global_recnum;
+  for (p = (const unsigned char*)buf->s;
+       uint32_get_lsb(p) != RECORD_EOT;
+       p += HEADER_SIZE + reclen + HASH_SIZE) {
+    reclen = uint32_get_lsb(p+16);
+    handle_record(uint32_get_lsb(p), uint32_get_lsb(p+8),
+		  uint32_get_lsb(p+12), reclen, (const char*)p + HEADER_SIZE);
+    global_recnum++;
+  }
+  reader_trans_time = uint32_get_lsb(p+12);
+  end_transaction();
+}
+
+/* Returns true if the page at offset starts with the marker left after
+   the last transaction the reader has seen. */
+static int at_marker(int fd, uint32 offset)
+{
+  unsigned char eot[EOT_SIZE];
+  return read_at(fd, offset, eot, EOT_SIZE)
+    && uint32_get_lsb(eot) == RECORD_EOT
+    && uint32_get_lsb(eot+4) == global_recnum
+    && check_record(eot, (char*)eot + HEADER_SIZE, 0);
+}
+
+static const struct stats* open_stats(void)
+{
+  const struct stats* s;
+  int fd;
+  if ((fd = open(reader_stats, O_RDONLY)) == -1)
+    die3sys(1, "Could not open '", reader_stats, "'");
+  s = mmap(0, sizeof *s, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (s == (const struct stats*)MAP_FAILED)
+    die3sys(1, "Could not map '", reader_stats, "'");
+  if (memcmp(s->magic, STATS_MAGIC, sizeof s->magic) != 0
+      || s->size != sizeof *s)
+    die3(1, "'", reader_stats, "' is not a journald statistics file");
+  return s;
+}
+
+/* The end of transaction record carries the number of the record
+   following the transaction. */
+static int synced(const struct stats* s, const str* buf)
+{
+  return s == 0
+    || !recnum_after(uint32_get_lsb(buf->s + buf->len - EOT_SIZE + 4),
+		     s->synced);
+}
+
+static void abort_all(void)
+{
+  stream* h;
+  while ((h = streams) != 0) {
+    if (!h->ignored) abort_stream(h);
+    del_stream(h);
+  }
+}
+
+static int open_watch(const char* filename)
+{
+#ifdef __linux__
+  int fd;
+  if ((fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) == -1) return -1;
+  if (inotify_add_watch(fd, filename, IN_MODIFY) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+#else
+  filename = filename;
+  return -1;
+#endif
+}
+
+/* Sleeps until the journal is modified, or for the poll interval.
+   Writes through a shared mapping do not generate notifications, so the
+   interval also bounds the delay for the mmap writer. */
+static void wait_for_data(int watch)
+{
+  struct pollfd p;
+  char buf[4096];
+  p.fd = watch;
+  p.events = POLLIN;
+  if (poll(&p, watch == -1 ? 0 : 1, reader_poll) > 0)
+    while (read(watch, buf, sizeof buf) > 0)
+      ;
+}
+
+static void follow_journal(const char* filename)
+{
+  str buf = {0,0,0};
+  const struct stats* s;
+  uint32 offset;
+  uint32 first;
+  int watch;
+  int fd;
+
+  if (version < 3)
+    die3(1, "'", filename, "' is a version 2 journal, which can't be followed");
+  if ((fd = open(filename, O_RDONLY)) == -1)
+    die3sys(1, "Could not open '", filename, "'");
+  watch = open_watch(filename);
+  s = reader_stats ? open_stats() : 0;
+  signal(SIGTERM, stop_following);
+  signal(SIGINT, stop_following);
+  offset = reader_pagesize;
+  while (!follow_stopped) {
+    if (load_transaction(fd, offset, &buf) && synced(s, &buf)) {
+      process_transaction(offset, &buf);
+      offset += buf.len;
+      if (offset % reader_pagesize)
+	offset += reader_pagesize - offset % reader_pagesize;
+      continue;
+    }
+    if (reread_first_recnum(fd, &first) && first != reader_first_recnum) {
+      if (first == global_recnum && at_marker(fd, offset)) {
+	reader_first_recnum = first;
+	offset = reader_pagesize;
+	continue;
+      }
+      if (recnum_after(first, global_recnum)) {
+	warn3("Journal '", filename, "' was overwritten before it was read");
+	abort_all();
+	reader_first_recnum = global_recnum = first;
+	offset = reader_pagesize;
+	continue;
+      }
+    }
+    idle_journal();
+    wait_for_data(watch);
+  }
+  if (watch != -1) close(watch);
+  if (s) munmap((void*)s, sizeof *s);
+  close(fd);
+  str_free(&buf);
+}
+
+/* Parses a time given either as seconds since the epoch, or as a local
+   "YYYY-MM-DD" date optionally followed by " HH:MM:SS". */
+static uint32 parse_time(const char* s)
+{
+  struct tm tm;
+  char* end;
+  unsigned long u;
+  time_t t;
+  int n;
+  int len;
+  /* Both forms start with a digit, which also keeps strtoul from
+     accepting a sign or leading spaces. */
+  if (*s < '0' || *s > '9')
+    die3(1, "Invalid time '", s, "'");
+  errno = 0;
+  u = strtoul(s, &end, 10);
+  if (*end == 0) {
+    if (errno == ERANGE || u > 0xffffffffUL)
+      die3(1, "Invalid time '", s, "'");
+    return u;
+  }
+  memset(&tm, 0, sizeof tm);
+  len = -1;
+  n = sscanf(s, "%d-%d-%d%n %d:%d:%d%n", &tm.tm_year, &tm.tm_mon,
+	     &tm.tm_mday, &len, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &len);
+  if ((n != 3 && n != 6) || len < 0 || s[len] != 0)
+    die3(1, "Invalid time '", s, "'");
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  tm.tm_isdst = -1;
+  if ((t = mktime(&tm)) == (time_t)-1)
+    die3(1, "Invalid time '", s, "'");
+  return t;
+}
+
+/* Walks the record headers of the transaction at offset, without
+   reading the record data, to find its length and commit time. */
+static int scan_transaction(int fd, uint32 offset, uint32* length,
+			    uint32* records, uint32* when)
+{
+  unsigned char header[EOT_SIZE];
+  uint32 pos;
+  uint32 recnum;
+
+  for (pos = offset, recnum = global_recnum; ; ++recnum) {
+    if (!read_at(fd, pos, header, HEADER_SIZE)) return 0;
+    if (uint32_get_lsb(header+4) != recnum) return 0;
+    if (uint32_get_lsb(header) == RECORD_EOT) {
+      if (pos == offset
+	  || !read_at(fd, pos, header, EOT_SIZE)
+	  || !check_record(header, (char*)header + HEADER_SIZE, 0))
+	return 0;
+      *length = pos + EOT_SIZE - offset;
+      *records = recnum - global_recnum;
+      *when = uint32_get_lsb(header+12);
+      return 1;
+    }
+    pos += HEADER_SIZE + uint32_get_lsb(header+16) + HASH_SIZE;
+  }
+}
+
+/* Finds where to start reading for the given time with the index: the
+   first time mark at or after it, or else the last one. */
+static int seek_time(uint32 since, uint32* offset)
+{
+  struct jindex_entry* entries;
+  struct jindex_entry* mark;
+  unsigned count;
+  unsigned i;
+
+  if ((entries = jindex_load(reader_index, reader_pagesize,
+			     reader_first_recnum, &count)) == 0) {
+    warn3("Index '", reader_index, "' is missing or out of date, ignoring it");
+    return 0;
+  }
+  for (mark = 0, i = 0; i < count; i++)
+    if (entries[i].type == JINDEX_TIME) {
+      mark = &entries[i];
+      if (mark->strnum >= since) break;
+    }
+  if (mark) {
+    *offset = mark->info_offset;
+    global_recnum = mark->info_recnum;
+  }
+  free(entries);
+  return mark != 0;
+}
+
+/* Reads only the transactions committed within the --since/--until
+   window.  Transactions before the window are skipped over by their
+   headers, and reading stops at the first one after it. */
+static void read_window(const char* filename)
+{
+  str buf = {0,0,0};
+  uint32 since;
+  uint32 until;
+  uint32 offset;
+  uint32 length;
+  uint32 records;
+  uint32 when;
+  int fd;
+
+  if (version < 3)
+    die3(1, "'", filename, "' is a version 2 journal, which has no times");
+  since = reader_since ? parse_time(reader_since) : 0;
+  until = reader_until ? parse_time(reader_until) : (uint32)-1;
+  if ((fd = open(filename, O_RDONLY)) == -1)
+    die3sys(1, "Could not open '", filename, "'");
+  offset = reader_pagesize;
+  if (since && reader_index)
+    seek_time(since, &offset);
+  skipping = offset != reader_pagesize;
+  while (scan_transaction(fd, offset, &length, &records, &when)) {
+    if (when > until) break;
+    if (when >= since) {
+      if (!load_transaction(fd, offset, &buf))
+	die1(1, "Record data was corrupted (check code mismatch).");
+      process_transaction(offset, &buf);
+    }
+    else {
+      global_recnum += records;
+      skipping = 1;
+    }
+    offset += length;
+    if (offset % reader_pagesize)
+      offset += reader_pagesize - offset % reader_pagesize;
+  }
+  close(fd);
+  str_free(&buf);
+}
+
+/*
+  The --state file holds one line of numbers: the journal's first
+  record number, the offset and record number of the transaction to
+  start the next run at, the record number this run finished at, and
+  the numbers of the streams that were still open.  The next run starts
+  at the transaction holding the oldest open stream's info record (or
+  at the end, if there were none), and only dispatches those open
+  streams and the ones that start later.
+*/
+static int load_state(ibuf* in, const char* filename)
+{
+  ibuf sin;
+  str line = {0,0,0};
+  unsigned long n[4];
+  unsigned long u;
+  unsigned i;
+  char* p;
+  char* end;
+  unsigned char header[HEADER_SIZE];
+
+  if (!ibuf_open(&sin, reader_state, 0)) {
+    if (errno != ENOENT)
+      die3sys(1, "Could not open state file '", reader_state, "'");
+    return 0;
+  }
+  if (!ibuf_getstr(&sin, &line, LF) && !ibuf_eof(&sin))
+    die3sys(1, "Could not read state file '", reader_state, "'");
+  ibuf_close(&sin);
+  if (line.len == 0)
+    die3(1, "State file '", reader_state, "' is invalid");
+  for (p = line.s, i = 0; i < 4; p = end, i++) {
+    n[i] = strtoul(p, &end, 10);
+    if (end == p)
+      die3(1, "State file '", reader_state, "' is invalid");
+  }
+  for (;;) {
+    u = strtoul(p, &end, 10);
+    if (end == p) break;
+    if ((state_open = realloc(state_open, (state_open_count + 1)
+			      * sizeof *state_open)) == 0)
+      die1(1, "Out of memory");
+    state_open[state_open_count++] = u;
+    p = end;
+  }
+  str_free(&line);
+
+  if (n[0] != reader_first_recnum) {
+    warn3("Journal '", filename,
+	  "' has wrapped since the last run, reading all of it");
+    return 0;
+  }
+  if (!ibuf_seek(in, n[1])
+      || !ibuf_read(in, header, HEADER_SIZE)
+      || uint32_get_lsb(header+4) != n[2]
+      || !ibuf_seek(in, n[1])) {
+    warn3("State file '", reader_state,
+	  "' does not match the journal, reading all of it");
+    return 0;
+  }
+  global_recnum = n[2];
+  state_done = n[3];
+  state_loaded = 1;
+  return 1;
+}
+
+static void save_state(void)
+{
+  obuf out;
+  str tmp = {0,0,0};
+  const stream* h;
+  uint32 offset;
+  uint32 recnum;
+
+  offset = reader_trans_offset;
+  recnum = reader_trans_recnum;
+  for (h = streams; h != 0; h = h->next)
+    if (!h->ignored && recnum_before(h->info_recnum, recnum)) {
+      offset = h->info_offset;
+      recnum = h->info_recnum;
+    }
+  if (!str_copys(&tmp, reader_state) || !str_cats(&tmp, ".tmp"))
+    die1(1, "Out of memory");
+  if (!obuf_open(&out, tmp.s, O_WRONLY|O_CREAT|O_TRUNC, 0666, 0))
+    die3sys(1, "Could not create '", tmp.s, "'");
+  obuf_putu(&out, reader_first_recnum);
+  obuf_putc(&out, ' ');
+  obuf_putu(&out, offset);
+  obuf_putc(&out, ' ');
+  obuf_putu(&out, recnum);
+  obuf_putc(&out, ' ');
+  obuf_putu(&out, global_recnum);
+  for (h = streams; h != 0; h = h->next)
+    if (!h->ignored) {
+      obuf_putc(&out, ' ');
+      obuf_putu(&out, h->strnum);
+    }
+  obuf_putc(&out, LF);
+  if (!obuf_close(&out) || rename(tmp.s, reader_state) != 0)
+    die3sys(1, "Could not write state file '", reader_state, "'");
+  str_free(&tmp);
+}
+
+void read_journal(const char* filename)
+{
+  stream* h;
+  char header[FILE_HEADER_SIZE+FILE_OPTIONS_MAX];
   ibuf in;
 
   if (!ibuf_open(&in, filename, 0))
     die3sys(1, "Could not open '", filename, "'");
 
   /* Read/validate header record */
-  hash_init(&hash);
   if (!ibuf_read(&in, header, sizeof header))
     die3sys(1, "Could not read header from '", filename, "'");
-  hash_update(&hash, header, sizeof header - HASH_SIZE);
-  hash_finish(&hash, hashbuf);
-  if (memcmp(header + 24, hashbuf, HASH_SIZE) != 0)
+  if (!check_file_header(header))
     die3(1, "'", filename, "' has invalid header check code");
   if (memcmp(header, "journald", 8) != 0)
     die3(1, "'", filename, "' is not a journald file (missing signature)");
-  if (uint32_get_lsb(header+8) != 2)
-    die3(1, "'", filename, "' is not a version 2 journald file");
-  if ((pagesize = uint32_get_lsb(header+12)) == 0)
+  version = uint32_get_lsb(header+8);
+  if (version != 2 && version != 3)
+    die3(1, "'", filename, "' is not a version 2 or 3 journald file");
+  if ((reader_pagesize = uint32_get_lsb(header+12)) == 0)
     die3(1, "'", filename, "' has zero page size");
-  global_recnum = uint32_get_lsb(header+16);
-  if (uint32_get_lsb(header+20) != 0)
-    die3(1, "'", filename, "' has non-zero options length, can't handle it");
-  
-  if (!skip_page(&in))
+  global_recnum = reader_first_recnum = uint32_get_lsb(header+16);
+  if ((hash_type = hash_parse_options((unsigned char*)header+24,
+				      uint32_get_lsb(header+20))) < 0)
+    die3(1, "'", filename, "' has unknown header options, can't handle it");
+  load_patterns();
+  if (reader_follow && (reader_since || reader_until))
+    die1(1, "--since and --until can't be used with --follow");
+  if (reader_stats && !reader_follow)
+    die1(1, "--stats can only be used with --follow");
+  if (reader_state
+      && (reader_follow || reader_since || reader_until || reader_index))
+    die1(1, "--state can't be used with --follow, --since, --until, or --index");
+
+  if (reader_follow) {
+    ibuf_close(&in);
+    follow_journal(filename);
+    abort_all();
+    return;
+  }
+  /* Streams left open at the edges of the window are not complete
+     within it. */
+  if (reader_since || reader_until) {
+    ibuf_close(&in);
+    read_window(filename);
+    abort_all();
+    return;
+  }
+
+  if (reader_state && load_state(&in, filename))
+    skipping = 1;
+  else if (!ibuf_seek(&in, reader_pagesize))
     die3sys(1, "Could not skip first page of '", filename, "'");
 
-  while (read_transaction(&in))
-    ;
+  if (!reader_index || !literal_ident() || !read_indexed(&in))
+    while (read_transaction(&in))
+      ;
   ibuf_close(&in);
 
+  drop_ignored();
   if (streams) {
-    warn3("Premature end of data in journal '", filename, "'");
+    /* With a state file, open streams are picked up by the next run. */
+    if (!reader_state)
+      warn3("Premature end of data in journal '", filename, "'");
     for (h = streams; h != 0; h = h->next)
       abort_stream(h);
   }
@@ -255,7 +997,10 @@ int cli_main(int argc, char* argv[])
 {
   reader_argc = argc - 1;
   reader_argv = argv + 1;
+  start_journal();
   read_journal(argv[0]);
+  finish_journal();
+  if (reader_state) save_state();
   obuf_flush(&outbuf);
   return 0;
 }
@@ -9,6 +9,24 @@ extern const char program[];
 
 extern int reader_argc;
 extern char** reader_argv;
+extern const char* reader_index;
+extern const char* reader_ident;
+extern const char* reader_ident_file;
+extern int reader_follow;
+extern unsigned reader_poll;
+extern const char* reader_since;
+extern const char* reader_until;
+extern const char* reader_state;
+extern const char* reader_stats;
+extern int reader_headers_only;	/* append_stream gets no data */
+extern int reader_no_check;
+extern int reader_check_skipped;
+
+extern uint32 reader_pagesize;
+extern uint32 reader_first_recnum;
+extern uint32 reader_trans_offset;
+extern uint32 reader_trans_recnum;
+extern uint32 reader_trans_time;
 
 struct stream
 {
@@ -18,15 +36,22 @@ struct stream
   uint32 start_offset;
   uint32 identlen;
   char* ident;
+  uint32 info_offset;
+  uint32 info_recnum;
+  int ignored;
   struct stream* next;
   void* data;
 };
 typedef struct stream stream;
 
+extern void start_journal(void);
 extern void init_stream(stream* s);
 extern void append_stream(stream* s, const char* buf, uint32 reclen);
 extern void end_stream(stream* s);
 extern void abort_stream(stream* s);
+extern void finish_journal(void);
+extern void idle_journal(void);
+extern void end_transaction(void);
 
 extern void die(const char* msg);
 extern void read_journal(const char* filename);
@@ -0,0 +1,163 @@
+/* resume.c - Locate the end of an existing journal.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <string.h>
+
+#include <iobuf/iobuf.h>
+#include <msg/msg.h>
+#include <str/str.h>
+
+#include "flags.h"
+#include "hash.h"
+#include "writer.h"
+
+/*
+  The resume hint in the first page names a committed transaction
+  offset, and is rewritten every few commits.  Starting from there (or
+  from the first page if the hint is missing), transactions are
+  verified one at a time until one is found that is not completed by a
+  valid end of transaction record.  Writing resumes at the start of
+  that transaction, so the time taken is bounded by the hint interval
+  rather than by the size of the journal.
+
+  resume_scan returns 1 with the resume point filled in, 0 (after a
+  warning) if the file holds a journal that can't be resumed, or -1 if
+  it holds no journal at all.
+*/
+
+static int check_code(int type, const unsigned char* data, uint32 len,
+		      const unsigned char* code)
+{
+  HASH_CTX hash;
+  unsigned char hashbuf[HASH_SIZE];
+  hash_init_type(&hash, type);
+  hash_update(&hash, data, len);
+  hash_finish(&hash, hashbuf);
+  return memcmp(code, hashbuf, HASH_SIZE) == 0;
+}
+
+static int read_header(ibuf* in, unsigned char header[HEADER_SIZE],
+		       uint32 recnum)
+{
+  if (!ibuf_read(in, header, HEADER_SIZE)) return 0;
+  return uint32_get_lsb(header+4) == recnum
+    && uint32_get_lsb(header+16) < writer_size;
+}
+
+/* Verify one complete transaction starting at the current position,
+   updating the resume point only if it was completely committed. */
+static int scan_transaction(ibuf* in, struct resume_point* rp)
+{
+  unsigned char header[HEADER_SIZE];
+  uint32 recnum;
+  uint32 stream;
+  uint32 reclen;
+  static str buf;
+
+  recnum = rp->recnum;
+  stream = rp->stream;
+  if (!read_header(in, header, recnum)) return 0;
+  if (uint32_get_lsb(header) == RECORD_EOT) return 0;
+  for (;;) {
+    reclen = uint32_get_lsb(header+16);
+    if (!str_ready(&buf, HEADER_SIZE+reclen+HASH_SIZE)) return 0;
+    memcpy(buf.s, header, HEADER_SIZE);
+    if (!ibuf_read(in, buf.s+HEADER_SIZE, reclen+HASH_SIZE)) return 0;
+    if (!check_code(rp->check, buf.s, HEADER_SIZE+reclen,
+		    buf.s+HEADER_SIZE+reclen))
+      return 0;
+    if (uint32_get_lsb(header) == RECORD_EOT) break;
+    if (uint32_get_lsb(header+8) >= stream)
+      stream = uint32_get_lsb(header+8) + 1;
+    if (!read_header(in, header, ++recnum)) return 0;
+  }
+  if (uint32_get_lsb(header+8) > stream)
+    stream = uint32_get_lsb(header+8);
+  rp->recnum = recnum;
+  rp->stream = stream;
+  return 1;
+}
+
+static int fail(const char* path, const char* reason)
+{
+  warn4("Can't resume '", path, "': ", reason);
+  return 0;
+}
+
+int resume_scan(const char* path, struct resume_point* rp)
+{
+  unsigned char header[FILE_HEADER_SIZE+FILE_OPTIONS_MAX+HINT_SIZE];
+  unsigned char* hint;
+  uint32 optlen;
+  uint32 pos;
+  ibuf in;
+
+  if (!ibuf_open(&in, path, 0)) return fail(path, "could not open");
+  if (!ibuf_read(&in, header, sizeof header)) {
+    ibuf_close(&in);
+    return fail(path, "could not read header");
+  }
+  if (memcmp(header, "journald", 8) != 0) {
+    ibuf_close(&in);
+    return -1;
+  }
+  optlen = uint32_get_lsb(header+20);
+  if (uint32_get_lsb(header+8) != 3
+      || optlen > FILE_OPTIONS_MAX
+      || !check_code(HASH_CRC64, header, FILE_HEADER_SIZE-HASH_SIZE+optlen,
+		     header+FILE_HEADER_SIZE-HASH_SIZE+optlen)) {
+    ibuf_close(&in);
+    return fail(path, "no valid version 3 header");
+  }
+  if (uint32_get_lsb(header+12) != writer_pagesize) {
+    ibuf_close(&in);
+    return fail(path, "page size has changed");
+  }
+  if ((rp->check = hash_parse_options(header+24, optlen)) < 0) {
+    ibuf_close(&in);
+    return fail(path, "unknown header options");
+  }
+  rp->first_recnum = uint32_get_lsb(header+16);
+
+  hint = header + FILE_HEADER_SIZE + optlen;
+  rp->offset = uint32_get_lsb(hint);
+  if (check_code(rp->check, hint, HINT_SIZE-HASH_SIZE,
+		 hint+HINT_SIZE-HASH_SIZE)
+      && rp->offset >= writer_pagesize
+      && rp->offset % writer_pagesize == 0
+      && rp->offset < writer_size) {
+    rp->recnum = uint32_get_lsb(hint+4);
+    rp->stream = uint32_get_lsb(hint+8);
+  }
+  else {
+    rp->offset = writer_pagesize;
+    rp->recnum = rp->first_recnum;
+    rp->stream = 0;
+  }
+
+  for (;;) {
+    if (!ibuf_seek(&in, rp->offset)) break;
+    if (!scan_transaction(&in, rp)) break;
+    pos = ibuf_tell(&in);
+    rp->offset = (pos + writer_pagesize - 1) / writer_pagesize
+      * writer_pagesize;
+  }
+  ibuf_close(&in);
+  if (rp->offset + writer_pagesize > writer_size)
+    return fail(path, "end of journal is past the end of the file");
+  return 1;
+}
@@ -0,0 +1,244 @@
+/* ring.c - Shared memory ring transport for local producers.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#define _GNU_SOURCE	/* for memfd_create */
+#include <sys/types.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <uint64.h>
+
+#include "ring.h"
+#include "server.h"
+
+/*
+  A producer asks for a ring on a normal connection (see socketio.c).
+  The daemon creates a memory file holding the ring and two eventfds,
+  and passes all three back over the connection with a single status
+  byte.  The connection then stays open only to detect the producer
+  going away; all transactions go through the ring, and each one is
+  acknowledged by advancing the completed count once it is committed.
+*/
+
+struct ring
+{
+  struct ring_control* control;
+  unsigned char* data;
+  uint32 size;
+  int data_fd;			/* signalled by the producer */
+  int ack_fd;			/* signalled by the daemon */
+};
+
+#if defined(MFD_CLOEXEC) && defined(EFD_NONBLOCK)
+
+static void ring_free(struct ring* r)
+{
+  if (r->control)
+    munmap((void*)r->control, RING_HEADER_SIZE + r->size);
+  if (r->data_fd != -1) close(r->data_fd);
+  if (r->ack_fd != -1) close(r->ack_fd);
+  free(r);
+}
+
+static int send_fds(int sock, const int* fds, int count)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } control;
+  char status = 1;
+
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = &status;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+  return sendmsg(sock, &msg, 0) == 1;
+}
+
+int ring_start(connection* con)
+{
+  struct ring* r;
+  uint32 want;
+  uint32 size;
+  int fds[3];
+  void* map;
+
+  want = con->ring_size ? con->ring_size : RING_DEFAULT_SIZE;
+  if (want > RING_MAX_SIZE) want = RING_MAX_SIZE;
+  for (size = 4096; size < want * 1024; size <<= 1)
+    ;
+
+  if ((r = calloc(1, sizeof *r)) == 0) return 0;
+  r->size = size;
+  r->data_fd = r->ack_fd = -1;
+  if ((fds[0] = memfd_create("journald-ring", MFD_CLOEXEC)) == -1) {
+    ring_free(r);
+    return 0;
+  }
+  if (ftruncate(fds[0], RING_HEADER_SIZE + size) == -1
+      || (map = mmap(0, RING_HEADER_SIZE + size, PROT_READ|PROT_WRITE,
+		     MAP_SHARED, fds[0], 0)) == MAP_FAILED) {
+    close(fds[0]);
+    ring_free(r);
+    return 0;
+  }
+  r->control = map;
+  r->data = (unsigned char*)map + RING_HEADER_SIZE;
+  r->control->size = size;
+  if ((r->data_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1
+      || (r->ack_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+    close(fds[0]);
+    ring_free(r);
+    return 0;
+  }
+  fds[1] = r->data_fd;
+  fds[2] = r->ack_fd;
+  if (!send_fds(con->fd, fds, 3)) {
+    close(fds[0]);
+    ring_free(r);
+    return 0;
+  }
+  close(fds[0]);
+  con->ring = r;
+  con->mode = MODE_RING;
+  con->state = 0;
+  return 1;
+}
+
+void ring_stop(connection* con)
+{
+  if (con->ring) {
+    ring_free(con->ring);
+    con->ring = 0;
+  }
+}
+
+int ring_fd(const connection* con)
+{
+  return con->ring->data_fd;
+}
+
+static void wake_client(struct ring* r)
+{
+  uint64 one = 1;
+  ring_barrier();
+  if (r->control->client_waiting)
+    write(r->ack_fd, &one, sizeof one);
+}
+
+/* Returns true if there is data to consume.  Otherwise, the producer is
+   asked to signal the eventfd when it adds some. */
+int ring_ready(connection* con)
+{
+  struct ring_control* c = con->ring->control;
+  if (c->head != c->tail) return 1;
+  c->server_waiting = 1;
+  ring_barrier();
+  if (c->head != c->tail) {
+    c->server_waiting = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/* Feeds up to budget bytes from the ring to the protocol state machine,
+   stopping early at the end of a transaction.  If the eventfd was
+   signalled, it is cleared first. */
+uint32 ring_consume(connection* con, uint32 budget, int signalled)
+{
+  struct ring* r = con->ring;
+  struct ring_control* c = r->control;
+  uint64 count;
+  uint32 head;
+  uint32 offset;
+  uint32 avail;
+  uint32 used;
+  uint32 total;
+
+  c->server_waiting = 0;
+  if (signalled)
+    read(r->data_fd, &count, sizeof count);
+  total = 0;
+  while (budget > 0) {
+    head = c->head;
+    ring_barrier();
+    if ((avail = head - c->tail) == 0) break;
+    offset = c->tail & (r->size - 1);
+    if (avail > r->size - offset) avail = r->size - offset;
+    if (avail > budget) avail = budget;
+    used = handle_data(con, (char*)r->data + offset, avail);
+    ring_barrier();
+    c->tail += used;
+    total += used;
+    budget -= used;
+    if (con->state == -1) break;
+  }
+  if (total) wake_client(r);
+  return total;
+}
+
+void ring_complete(connection* con, uint32 count, int ok)
+{
+  struct ring_control* c = con->ring->control;
+  if (!ok) c->error = 1;
+  ring_barrier();
+  c->completed += count;
+  ring_barrier();
+  wake_client(con->ring);
+}
+
+#else
+
+/* Without memory files and eventfds, ring requests are refused. */
+int ring_start(connection* con) { con = con; return 0; }
+void ring_stop(connection* con) { con = con; }
+int ring_fd(const connection* con) { con = con; return -1; }
+int ring_ready(connection* con) { con = con; return 0; }
+uint32 ring_consume(connection* con, uint32 budget, int signalled)
+{
+  con = con;
+  budget = budget;
+  signalled = signalled;
+  return 0;
+}
+void ring_complete(connection* con, uint32 count, int ok)
+{
+  con = con;
+  count = count;
+  ok = ok;
+}
+
+#endif
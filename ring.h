@@ -0,0 +1,41 @@
+#ifndef JOURNALD__RING__H__
+#define JOURNALD__RING__H__
+
+#include <uint32.h>
+
+/*
+  Layout of the shared memory ring.  The control block fills the first
+  RING_HEADER_SIZE bytes of the memory file, and the data area follows.
+  The data area size is a power of two, and head and tail are free
+  running byte counts that are masked to index it.  The producer writes
+  transactions into the data area in the socket protocol format, and
+  only advances head; the daemon only advances tail.  Each side sets
+  its waiting flag before sleeping on its eventfd, and the other side
+  writes to that eventfd only when the flag is set.
+*/
+
+/* Set in the top byte of the first length to request a ring */
+#define RING_REQUEST 0x80
+
+#define RING_HEADER_SIZE 4096
+#define RING_DEFAULT_SIZE 256	/* kilobytes */
+#define RING_MAX_SIZE 16384	/* kilobytes */
+
+struct ring_control
+{
+  uint32 size;
+  uint32 pad1[15];
+  /* Written by the producer */
+  volatile uint32 head;
+  volatile uint32 client_waiting;
+  uint32 pad2[14];
+  /* Written by the daemon */
+  volatile uint32 tail;
+  volatile uint32 completed;	/* transactions committed */
+  volatile uint32 error;	/* set if a transaction failed */
+  volatile uint32 server_waiting;
+};
+
+#define ring_barrier() __sync_synchronize()
+
+#endif
@@ -1,10 +1,32 @@
 #ifndef JOURNALD__SERVER__H__
 #define JOURNALD__SERVER__H__
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <uint32.h>
+#include <uint64.h>
+#include "ring.h"
 
 #define IDENTSIZE 1024
 #define CBUFSIZE 8192
+#define READSIZE 4096
+#define FDQUEUE 16
+
+#define PRIORITY_NORMAL 0
+#define PRIORITY_URGENT 1
+#define PRIORITY_BULK 2
+#define PRIORITY_CLASSES 3
+
+#define MODE_STREAM 0		/* one transaction per stream connection */
+#define MODE_DATAGRAM 1		/* one transaction per datagram */
+#define MODE_RING 2		/* transactions through a shared memory ring */
+
+/* Set in a record length to pull the record from a passed descriptor */
+#define PULL_RECORD 0x80000000
+
+/* The largest transaction accepted as a single datagram */
+#define DGRAM_MAX 65536
 
 struct connection 
 {
@@ -14,12 +36,31 @@ struct connection
   uint32 count;
   uint32 length;
   uint32 ident_len;
+  uint32 priority;
   uint32 buf_length;
   int wrote_ident;
   int ok;
   uint32 total;
   uint32 records;
   uint32 number;
+  uint32 info_offset;
+  uint32 info_recnum;
+  uint64 done_time;
+  uint64 last_active;
+  uint32 received;
+  struct sockaddr_un peer;
+  socklen_t peer_len;
+  struct ring* ring;
+  uint32 ring_size;		/* requested ring size in kilobytes */
+  uint32 ring_ended;		/* transactions ended but not yet committed */
+  uint32 ring_ended_bytes;	/* bytes received for those transactions */
+  int fds[FDQUEUE];		/* descriptors received but not yet used */
+  uint32 fd_count;
+  int pull_fd;
+  uint64 pull_offset;
+  uint32 pending_pos;		/* input left over when a pull started */
+  uint32 pending_len;
+  char pending[READSIZE];
   
   char ident[IDENTSIZE];
   char buf[CBUFSIZE];
@@ -28,10 +69,23 @@ typedef struct connection connection;
 
 extern connection* connections;
 extern unsigned opt_connections;
+extern unsigned opt_hint_interval;
+extern const char* opt_index;
+extern unsigned long connection_number;
 
 extern void die(const char* msg);
-extern void handle_data(connection* con, char* data, uint32 size);
-extern int open_journal(const char* filename);
+extern uint32 handle_data(connection* con, char* data, uint32 size);
+extern uint32 direct_space(connection* con);
+extern void direct_data(connection* con, uint32 size);
+
+/* ring.c */
+extern int ring_start(connection* con);
+extern void ring_stop(connection* con);
+extern int ring_fd(const connection* con);
+extern int ring_ready(connection* con);
+extern uint32 ring_consume(connection* con, uint32 budget, int signalled);
+extern void ring_complete(connection* con, uint32 count, int ok);
+extern int open_journal(const char* filename, int resume);
 extern int write_record(connection* con, int final, int do_abort);
 extern int sync_records(void);
 extern int rotate_journal(void);
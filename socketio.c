@@ -16,13 +16,16 @@
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 #include <string.h>
+#include <unistd.h>
 
 #include "server.h"
+#include "trace.h"
 
 /*
   Per-connection algorithm:
   - Accept connection
-  - Read in identifier length (state 0: reading identifier length)
+  - Read in identifier length and priority (state 0: reading identifier
+    length)
   - Read in identifier string (state 1: reading identifier)
   - read in record length (state 2: reading next record length)
   - while length is not zero:
@@ -31,6 +34,15 @@
     - read in next record length (state 2: reading next record length)
   - Send OK code (state -1: sending response)
   - Close connection
+
+  A record length with the top bit set is followed by a file offset,
+  and the record is instead pulled from the next descriptor passed on
+  the connection (state 5: reading offset, state 6: pulling record).
+
+  If the identifier length has the ring request bit set in its top
+  byte, the connection instead asks for a shared memory ring (state 4:
+  ring requested), and the transactions are read from the ring in the
+  same format (see ring.c).
 */
 
 static uint32 read_ident_length(connection* con,
@@ -48,7 +60,19 @@ static uint32 read_ident_length(connection* con,
     size--;
     if (con->count == 4) {
       con->count = 0;
-      con->state = 1;
+      con->priority = con->ident_len >> 24;
+      con->ident_len &= 0xffffff;
+      if ((con->priority & RING_REQUEST) && con->mode == MODE_STREAM) {
+	con->priority &= ~RING_REQUEST;
+	con->ring_size = con->ident_len;
+	con->ident_len = 0;
+	con->state = (con->priority < PRIORITY_CLASSES) ? 4 : -1;
+      }
+      else if (con->ident_len > IDENTSIZE
+	       || con->priority >= PRIORITY_CLASSES)
+	con->state = -1;
+      else
+	con->state = 1;
       break;
     }
   }
@@ -66,6 +90,7 @@ static uint32 read_ident(connection* con,
   memcpy(con->ident+con->count, bytes, used);
   con->count += used;
   if (con->count == con->ident_len) {
+    trace(TRACE_IDENT, con->number, con->ident_len);
     con->count = 0;
     con->length = 0;
     con->state = 2;
@@ -73,6 +98,41 @@ static uint32 read_ident(connection* con,
   return used;
 }
 
+static void abort_stream(connection* con)
+{
+  write_record(con, 0, 1);
+  con->state = -1;
+}
+
+static uint32 read_pull_offset(connection* con,
+			       unsigned char* bytes,
+			       uint32 size)
+{
+  uint32 used;
+  used = 0;
+  while (size) {
+    con->pull_offset <<= 8;
+    con->pull_offset |= *bytes;
+    con->count++;
+    used++;
+    bytes++;
+    size--;
+    if (con->count == 8) {
+      con->count = 0;
+      if (con->fd_count == 0)
+	abort_stream(con);
+      else {
+	con->pull_fd = con->fds[0];
+	--con->fd_count;
+	memmove(con->fds, con->fds + 1, con->fd_count * sizeof(int));
+	con->state = 6;
+      }
+      break;
+    }
+  }
+  return used;
+}
+
 static uint32 read_record_length(connection* con,
 				 unsigned char* bytes,
 				 uint32 size)
@@ -87,7 +147,16 @@ static uint32 read_record_length(connection* con,
     bytes++;
     size--;
     if (con->count == 4) {
-      if (con->length) {
+      if (con->length & PULL_RECORD) {
+	con->length &= ~PULL_RECORD;
+	con->count = 0;
+	con->pull_offset = 0;
+	if (con->length)
+	  con->state = 5;
+	else
+	  abort_stream(con);
+      }
+      else if (con->length) {
 	con->count = 0;
 	con->state = 3;
       }
@@ -134,14 +203,56 @@ static uint32 read_record(connection* con,
   return used;
 }
 
-void handle_data(connection* con, char* data, uint32 size)
+/* While a record is being read, the data can be read from the socket
+   straight into the connection's record buffer, and a pulled record is
+   read there from its descriptor.  This returns the space
+   available there, or 0 if the connection is not in the middle of a
+   record (or if writing out the full buffer failed). */
+uint32 direct_space(connection* con)
+{
+  uint32 space;
+  if (con->state != 3 && con->state != 6) return 0;
+  if (con->buf_length == CBUFSIZE)
+    if (!write_record(con, 0, 0)) {
+      con->state = -1;
+      return 0;
+    }
+  space = CBUFSIZE - con->buf_length;
+  if (space > con->length - con->count) space = con->length - con->count;
+  return space;
+}
+
+/* Account for data read into the space given by direct_space. */
+void direct_data(connection* con, uint32 size)
+{
+  con->buf_length += size;
+  con->count += size;
+  if (con->state == 6)
+    con->pull_offset += size;
+  if (con->count == con->length) {
+    if (con->state == 6) {
+      close(con->pull_fd);
+      con->pull_fd = -1;
+    }
+    con->count = 0;
+    con->length = 0;
+    con->state = 2;
+  }
+}
+
+/* Returns the number of bytes used, which is less than the size given
+   if the transaction ended, a record is to be pulled, or a ring was
+   requested. */
+uint32 handle_data(connection* con, char* data, uint32 size)
 {
   uint32 used;
+  uint32 total;
+  total = size;
   if (!size) {
     write_record(con, 0, 1);
   }
   else {
-    while (size && con->state != -1) {
+    while (size && con->state != -1 && con->state != 4 && con->state != 6) {
       used = 0;
 #ifdef DEBUG
       printf("state=%d byte=%d length=%ld buf_length=%ld count=%d ",
@@ -152,6 +263,7 @@ void handle_data(connection* con, char* data, uint32 size)
       case 1: used = read_ident(con, data, size); break;
       case 2: used = read_record_length(con, data, size); break;
       case 3: used = read_record(con, data, size); break;
+      case 5: used = read_pull_offset(con, data, size); break;
       default: die("Invalid state in handle_data");
       }
       size -= used;
@@ -164,4 +276,5 @@ void handle_data(connection* con, char* data, uint32 size)
     fflush(stdout);
 #endif
   }
+  return total - size;
 }
@@ -0,0 +1,103 @@
+/* stats.c - Shared memory statistics page.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <sys/types.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/*
+  The daemon is the only writer, so the counters are updated without
+  any locking.  Until a statistics file is opened, the counters are
+  kept in a private structure so the updates need no tests either.
+*/
+
+static struct stats private_stats;
+struct stats* stats = &private_stats;
+
+int stats_open(const char* path)
+{
+  int fd;
+  struct stats* s;
+  if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1) return 0;
+  if (ftruncate(fd, sizeof *s) == -1) {
+    close(fd);
+    return 0;
+  }
+  s = mmap(0, sizeof *s, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (s == MAP_FAILED) return 0;
+  memcpy(s, stats, sizeof *s);
+  memcpy(s->magic, STATS_MAGIC, sizeof s->magic);
+  s->size = sizeof *s;
+  s->start_time = stats_now();
+  stats = s;
+  return 1;
+}
+
+/* Times are taken from the monotonic clock, so stepping the system
+   clock can't produce bogus latencies or stall deadlines. */
+uint64 stats_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+unsigned hist_bucket(uint64 value)
+{
+  unsigned e;
+  unsigned b;
+  if (value < 8) return value;
+  for (e = 3; e < 63 && (value >> (e+1)) != 0; e++)
+    ;
+  b = (e - 1) * 4 + ((value >> (e - 2)) & 3);
+  return (b < HIST_BUCKETS) ? b : HIST_BUCKETS - 1;
+}
+
+uint64 hist_bucket_min(unsigned bucket)
+{
+  if (bucket < 8) return bucket;
+  return (uint64)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+void hist_add(struct histogram* h, uint64 value)
+{
+  ++h->count;
+  h->sum += value;
+  if (value > h->max) h->max = value;
+  ++h->buckets[hist_bucket(value)];
+}
+
+/* Returns the lower bound of the bucket holding the given fraction (in
+   thousandths) of the values. */
+uint64 hist_percentile(const struct histogram* h, unsigned permille)
+{
+  uint64 want;
+  uint64 seen;
+  unsigned i;
+  if (h->count == 0) return 0;
+  want = (h->count * permille + 999) / 1000;
+  for (i = 0, seen = 0; i < HIST_BUCKETS; i++)
+    if ((seen += h->buckets[i]) >= want)
+      return hist_bucket_min(i);
+  return h->max;
+}
@@ -0,0 +1,54 @@
+#ifndef JOURNALD__STATS__H__
+#define JOURNALD__STATS__H__
+
+#include <uint32.h>
+#include <uint64.h>
+
+/* Log-linear histogram: values below 8 have their own bucket, and each
+   power of two above that is split into 4 buckets. */
+#define HIST_BUCKETS 160
+
+struct histogram
+{
+  uint64 count;
+  uint64 sum;
+  uint64 max;
+  uint64 buckets[HIST_BUCKETS];
+};
+
+#define STATS_MAGIC "jdstats1"
+
+struct stats
+{
+  char magic[8];
+  uint32 size;
+  uint32 pagesize;
+  uint64 start_time;		/* monotonic microseconds (stats_now) */
+  uint64 bytes;
+  uint64 records;
+  uint64 transactions;
+  uint64 aborts;
+  uint64 commits;
+  uint64 failed_commits;
+  uint64 wraps;
+  uint64 padding;
+  uint64 connections;
+  uint64 active_connections;
+  uint64 inflight;		/* bytes received but not yet acknowledged */
+  uint64 reaped;		/* idle connections aborted */
+  uint32 synced;		/* next record number after the last sync */
+  struct histogram commit_size;	/* transactions per commit */
+  struct histogram sync_latency; /* microseconds in writer_sync */
+  struct histogram ack_latency;	/* microseconds from end of data to ack */
+};
+
+extern struct stats* stats;
+
+extern int stats_open(const char* path);
+extern uint64 stats_now(void);
+extern unsigned hist_bucket(uint64 value);
+extern uint64 hist_bucket_min(unsigned bucket);
+extern void hist_add(struct histogram* h, uint64 value);
+extern uint64 hist_percentile(const struct histogram* h, unsigned permille);
+
+#endif
@@ -0,0 +1,94 @@
+/* trace.c - In-memory ring of connection lifecycle events.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdio.h"
+#include "stats.h"
+#include "trace.h"
+
+/*
+  Events are stamped with the raw cycle counter where one is available,
+  and converted to microseconds only when the ring is dumped.  The ring
+  size is a power of two, so the position is simply masked, and old
+  events are overwritten when it wraps.
+*/
+
+struct trace_event* trace_ring = 0;
+uint32 trace_mask;
+uint32 trace_pos = 0;
+volatile int trace_dump_requested = 0;
+
+static uint64 start_ticks;
+static uint64 start_usec;
+
+#ifndef trace_clock
+uint64 trace_clock(void)
+{
+  return stats_now();
+}
+#endif
+
+int trace_init(unsigned events)
+{
+  uint32 size;
+  for (size = 1; size < events && size < TRACE_EVENTS_MAX; size <<= 1)
+    ;
+  if ((trace_ring = calloc(size, sizeof *trace_ring)) == 0) return 0;
+  trace_mask = size - 1;
+  start_usec = stats_now();
+  start_ticks = trace_clock();
+  return 1;
+}
+
+int trace_dump(const char* path)
+{
+  struct trace_header h;
+  uint32 first;
+  uint32 last;
+  int fd;
+  int ok;
+
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, TRACE_MAGIC, sizeof h.magic);
+  h.start_ticks = start_ticks;
+  h.start_usec = start_usec;
+  h.end_usec = stats_now();
+  h.end_ticks = trace_clock();
+  if (trace_pos > trace_mask) {
+    h.count = trace_mask + 1;
+    h.dropped = trace_pos - h.count;
+  }
+  else
+    h.count = trace_pos;
+  first = (trace_pos - h.count) & trace_mask;
+  last = first + h.count;
+  if (last > trace_mask + 1) last = trace_mask + 1;
+
+  if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1) return 0;
+  ok = write_all(fd, &h, sizeof h)
+    && write_all(fd, trace_ring + first,
+		 (last - first) * sizeof *trace_ring)
+    && write_all(fd, trace_ring,
+		 (h.count - (last - first)) * sizeof *trace_ring);
+  if (close(fd) == -1) ok = 0;
+  return ok;
+}
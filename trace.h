@@ -0,0 +1,71 @@
+#ifndef JOURNALD__TRACE__H__
+#define JOURNALD__TRACE__H__
+
+#include <uint32.h>
+#include <uint64.h>
+
+#define TRACE_ACCEPT 1		/* connection accepted */
+#define TRACE_IDENT 2		/* identifier completely read */
+#define TRACE_RECORD 3		/* journal record written, arg=length */
+#define TRACE_EOS 4		/* end of stream or abort, arg=ok */
+#define TRACE_COMMIT_START 5	/* sync started, arg=commit number */
+#define TRACE_COMMIT_END 6	/* sync completed, arg=success */
+#define TRACE_ACK 7		/* response sent, arg=response code */
+
+#define TRACE_MAGIC "jdtrace1"
+#define TRACE_EVENTS_MAX (1UL << 24)
+#define TRACE_NOCONN ((uint32)-1)
+
+struct trace_event
+{
+  uint64 time;
+  uint32 number;
+  uint32 type;
+  uint32 arg;
+  uint32 pad;
+};
+
+/* The dump file is this header followed by the events, oldest first.
+   Event times are in clock ticks; the two calibration points relate
+   them to microseconds. */
+struct trace_header
+{
+  char magic[8];
+  uint32 count;
+  uint32 dropped;
+  uint64 start_ticks;
+  uint64 start_usec;
+  uint64 end_ticks;
+  uint64 end_usec;
+};
+
+extern struct trace_event* trace_ring;
+extern uint32 trace_mask;
+extern uint32 trace_pos;
+extern volatile int trace_dump_requested;
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define trace_clock() __extension__ ({ \
+  uint32 lo_; uint32 hi_; \
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo_), "=d" (hi_)); \
+  ((uint64)hi_ << 32) | lo_; })
+#else
+extern uint64 trace_clock(void);
+#endif
+
+/* Recording an event is a test, a clock read, and four stores, so the
+   macro is left in the fast paths unconditionally. */
+#define trace(TYPE,NUMBER,ARG) do { \
+  if (trace_ring) { \
+    struct trace_event* e_ = &trace_ring[trace_pos++ & trace_mask]; \
+    e_->time = trace_clock(); \
+    e_->number = (NUMBER); \
+    e_->type = (TYPE); \
+    e_->arg = (ARG); \
+  } \
+} while (0)
+
+extern int trace_init(unsigned events);
+extern int trace_dump(const char* path);
+
+#endif
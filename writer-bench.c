@@ -0,0 +1,293 @@
+/* writer-bench.c - Benchmark the journal writer methods in isolation.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cli/cli.h>
+#include <iobuf/iobuf.h>
+#include <msg/msg.h>
+#include <str/str.h>
+
+#include "hash.h"
+#include "stats.h"
+#include "writer.h"
+
+const char program[] = "writer-bench";
+const int msg_show_pid = 0;
+const char cli_help_prefix[] =
+"Measures the speed of the journal writer methods without the daemon\n";
+const char cli_help_suffix[] =
+"\nThe file must already exist, and its contents will be overwritten.\n"
+"With --kernel, no file is written; instead the record copy and check\n"
+"code are timed in memory, computing the check code in a separate pass\n"
+"over the source (two-pass) and while copying (fused), for each check\n"
+"code algorithm unless --check is given.\n"
+"Each commit writes the given number of pages and then syncs them.  The\n"
+"sync latency percentiles cover only the sync call, while the commit\n"
+"latencies include the page writes, which is where the open+sync and\n"
+"open+direct methods wait for the disk.  Times are in microseconds.\n";
+const char cli_args_usage[] = "filename";
+const int cli_args_min = 1;
+const int cli_args_max = 1;
+
+static const char* opt_writers = 0;
+static unsigned opt_pages = 1;
+static unsigned opt_commits = 1000;
+static unsigned opt_rate = 0;
+static unsigned opt_pagesize = 0;
+static unsigned opt_kernel = 0;
+static unsigned opt_writeback = 0;
+static const char* opt_check = 0;
+cli_option cli_options[] = {
+  { 'w', "writers", CLI_STRING, 0, &opt_writers,
+    "Comma separated list of writer methods to test", "all" },
+  { 'P', "pages", CLI_UINTEGER, 0, &opt_pages,
+    "Pages written per commit", "1" },
+  { 'C', "commits", CLI_UINTEGER, 0, &opt_commits,
+    "Number of commits per method", "1000" },
+  { 'R', "rate", CLI_UINTEGER, 0, &opt_rate,
+    "Commits per second", "unlimited" },
+  { 's', "pagesize", CLI_UINTEGER, 0, &opt_pagesize,
+    "Minimum page size in bytes", "system page size" },
+  { 0, "writeback", CLI_UINTEGER, 0, &opt_writeback,
+    "Start writing back every N pages as they fill", "0" },
+  { 'k', "kernel", CLI_UINTEGER, 0, &opt_kernel,
+    "Time the record copy and check code with N byte records", 0 },
+  { 'c', "check", CLI_STRING, 0, &opt_check,
+    "Check code algorithm to time with --kernel", "all" },
+  {0,0,0,0,0,0,0}
+};
+
+static const char* filename;
+
+static void sleep_until(uint64 when)
+{
+  uint64 t;
+  while ((t = stats_now()) < when)
+    usleep(when - t);
+}
+
+static void show(const char* name, unsigned long value)
+{
+  obuf_putc(&outbuf, ' ');
+  obuf_puts(&outbuf, name);
+  obuf_putc(&outbuf, '=');
+  obuf_putu(&outbuf, value);
+}
+
+static void report(const char* name, const struct histogram* h,
+		   const struct histogram* commit, uint64 pages, uint64 elapsed)
+{
+  if (elapsed == 0) elapsed = 1;
+  obuf_puts(&outbuf, name);
+  show("pagesize", writer_pagesize);
+  show("writeback", writer_writeback);
+  show("commits", h->count);
+  show("pages/s", pages * 1000000 / elapsed);
+  show("commits/s", h->count * 1000000 / elapsed);
+  show("KBps", pages * writer_pagesize / 1024 * 1000000 / elapsed);
+  if (h->count) {
+    show("sync_avg", h->sum / h->count);
+    show("p50", hist_percentile(h, 500));
+    show("p99", hist_percentile(h, 990));
+    show("p999", hist_percentile(h, 999));
+    show("max", h->max);
+    show("commit_p50", hist_percentile(commit, 500));
+    show("commit_p99", hist_percentile(commit, 990));
+  }
+  obuf_putc(&outbuf, LF);
+  obuf_flush(&outbuf);
+}
+
+/* Each method is run in its own process, since the writers have no way
+   to release their resources once initialized. */
+static void bench(const struct writer_method* m)
+{
+  struct histogram sync_latency;
+  struct histogram commit_latency;
+  uint64 pages;
+  uint64 start;
+  uint64 t0;
+  uint64 t1;
+  unsigned commit;
+  unsigned page;
+
+  m->select();
+  if (!writer_init(filename))
+    die3sys(1, "Could not initialize writer '", m->name, "'");
+  if (writer_size < writer_pagesize * (opt_pages + 1))
+    die3(1, "The file is too small for ", m->name, " at this page size");
+  memset(&sync_latency, 0, sizeof sync_latency);
+  memset(&commit_latency, 0, sizeof commit_latency);
+  pages = 0;
+  /* The first page is skipped, as it would hold the journal header. */
+  if (!writer_seek(writer_pagesize)) die1sys(1, "Seek failed");
+  start = stats_now();
+  for (commit = 0; commit < opt_commits; ++commit) {
+    if (opt_rate)
+      sleep_until(start + (uint64)commit * 1000000 / opt_rate);
+    if (writer_pos + writer_pagesize * opt_pages > writer_size)
+      if (!writer_seek(writer_pagesize)) die1sys(1, "Seek failed");
+    t0 = stats_now();
+    for (page = 0; page < opt_pages; ++page) {
+      memset(writer_pagebuf, commit, writer_pagesize);
+      if (!writer_writepage()) die1sys(1, "Write failed");
+    }
+    pages += opt_pages;
+    t1 = stats_now();
+    if (!writer_sync()) die1sys(1, "Sync failed");
+    hist_add(&sync_latency, stats_now() - t1);
+    hist_add(&commit_latency, stats_now() - t0);
+  }
+  report(m->name, &sync_latency, &commit_latency, pages, stats_now() - start);
+  _exit(0);
+}
+
+static void run(const struct writer_method* m)
+{
+  pid_t pid;
+  int status;
+  if ((pid = fork()) == -1) die1sys(1, "fork failed");
+  if (pid == 0) bench(m);
+  while (waitpid(pid, &status, 0) == -1)
+    if (errno != EINTR) die1sys(1, "waitpid failed");
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    warn3("Benchmark of '", m->name, "' failed");
+}
+
+#define KERNEL_SPAN (16*1024*1024)
+#define KERNEL_BYTES (512*1024*1024)
+
+static unsigned char* kernel_dst;
+static uint32 kernel_pos;
+
+/* Copies into pages of the destination as writer_write does, wrapping
+   around at the end of it. */
+static void kernel_copy(HASH_CTX* hash, const unsigned char* src, uint32 len)
+{
+  uint32 n;
+  while (len > 0) {
+    n = writer_pagesize - kernel_pos % writer_pagesize;
+    if (n > len) n = len;
+    if (hash)
+      hash_copy(hash, kernel_dst + kernel_pos, src, n);
+    else
+      memcpy(kernel_dst + kernel_pos, src, n);
+    kernel_pos = (kernel_pos + n) % KERNEL_SPAN;
+    src += n;
+    len -= n;
+  }
+}
+
+static void kernel_run(const char* name, const unsigned char* src, int fused)
+{
+  unsigned char hashbuf[HASH_SIZE];
+  HASH_CTX hash;
+  uint64 bytes;
+  uint64 start;
+  uint64 elapsed;
+  uint32 off;
+
+  kernel_pos = 0;
+  start = stats_now();
+  for (bytes = 0, off = 0; bytes < KERNEL_BYTES; bytes += opt_kernel) {
+    if (off + opt_kernel > KERNEL_SPAN) off = 0;
+    hash_init(&hash);
+    if (fused)
+      kernel_copy(&hash, src + off, opt_kernel);
+    else {
+      hash_update(&hash, src + off, opt_kernel);
+      kernel_copy(0, src + off, opt_kernel);
+    }
+    hash_finish(&hash, hashbuf);
+    off += opt_kernel;
+  }
+  if ((elapsed = stats_now() - start) == 0) elapsed = 1;
+  obuf_puts(&outbuf, name);
+  obuf_puts(&outbuf, " check=");
+  obuf_puts(&outbuf, hash_names[hash_type]);
+  show("record", opt_kernel);
+  show("records/s", bytes / opt_kernel * 1000000 / elapsed);
+  show("MBps", bytes * 1000000 / elapsed / (1024*1024));
+  obuf_putc(&outbuf, LF);
+  obuf_flush(&outbuf);
+}
+
+static void kernel_bench(void)
+{
+  unsigned char* src;
+  uint32 i;
+  int type;
+  if (opt_kernel > KERNEL_SPAN) usage(1, "The record size is too large");
+  writer_pagesize = writer_min_pagesize ? writer_min_pagesize : getpagesize();
+  if ((src = malloc(KERNEL_SPAN)) == 0
+      || (kernel_dst = malloc(KERNEL_SPAN)) == 0)
+    die1(1, "Out of memory");
+  for (i = 0; i < KERNEL_SPAN; i++)
+    src[i] = i * 7;
+  memset(kernel_dst, 0, KERNEL_SPAN);
+  for (type = 0; hash_names[type] != 0; ++type) {
+    if (opt_check) {
+      if (type != hash_type) continue;
+    }
+    else
+      hash_type = type;
+    kernel_run("two-pass", src, 0);
+    kernel_run("fused", src, 1);
+  }
+}
+
+int cli_main(int argc, char* argv[])
+{
+  const struct writer_method* m;
+  const char* p;
+  const char* end;
+  long syspage;
+
+  filename = argv[0];
+  if (opt_pages == 0 || opt_commits == 0)
+    usage(1, "There must be at least one page and commit");
+  /* The mmap writer needs pages aligned to the system page size. */
+  syspage = getpagesize();
+  writer_min_pagesize = (opt_pagesize + syspage - 1) / syspage * syspage;
+  if (opt_writeback > WRITER_WRITEBACK_MAX)
+    usage(1, "The writeback interval is too large");
+  writer_writeback = opt_writeback;
+  if (opt_check && !hash_select(opt_check))
+    usage(1, "Invalid check code algorithm");
+  if (opt_kernel) {
+    kernel_bench();
+    return 0;
+  }
+  if (opt_writers == 0) {
+    for (m = writer_methods; m->name != 0; ++m)
+      run(m);
+    return 0;
+  }
+  for (p = opt_writers; *p != 0; p = *end ? end + 1 : end) {
+    if ((end = strchr(p, ',')) == 0) end = p + strlen(p);
+    if ((m = writer_find(p, end - p)) == 0) usage(1, "Invalid writer name");
+    run(m);
+  }
+  return 0;
+  argc = argc;
+}
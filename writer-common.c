@@ -15,12 +15,20 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
+#define _GNU_SOURCE	/* for sync_file_range */
 #include <sys/types.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include <str/str.h>
+#include <uint64.h>
 
 #include "writer.h"
 
@@ -28,6 +36,7 @@ int (*writer_init)(const char* path);
 int (*writer_sync)(void);
 int (*writer_seek)(uint32 offset);
 int (*writer_writepage)(void);
+int (*writer_put)(uint32 offset, const void* data, uint32 len);
 
 uint32 writer_pos;
 uint32 writer_size;
@@ -35,39 +44,175 @@ uint32 writer_pagesize;
 unsigned char* writer_pagebuf;
 
 int writer_fd;
+uint32 writer_min_pagesize = 0;
+uint32 writer_writeback = 0;
+int writer_exclusive = 0;
+
+static uint32 writeback_start;
 
 extern void writer_fdatasync_select(void);
 extern void writer_mmap_select(void);
 extern void writer_open_direct_select(void);
 extern void writer_open_sync_select(void);
+extern void writer_sim_select(void);
 
-int writer_select(const char* name)
+const struct writer_method writer_methods[] = {
+  { "fdatasync", writer_fdatasync_select },
+  { "mmap", writer_mmap_select },
+  { "open+direct", writer_open_direct_select },
+  { "open+sync", writer_open_sync_select },
+  { "sim", writer_sim_select },
+  { 0, 0 }
+};
+
+const char* writer_params = 0;
+
+/* Finds the method named by the first len bytes of name.  Parameters
+   may follow the method name after a colon, and are left in
+   writer_params for its select function. */
+const struct writer_method* writer_find(const char* name, unsigned len)
 {
-  if (strcmp(name, "fdatasync") == 0)
-    writer_fdatasync_select();
-  else if (strcmp(name, "mmap") == 0)
-    writer_mmap_select();
-  else if (strcmp(name, "open+direct") == 0)
-    writer_open_direct_select();
-  else if (strcmp(name, "open+sync") == 0)
-    writer_open_sync_select();
+  const struct writer_method* m;
+  const char* colon;
+  static str params;
+  if ((colon = memchr(name, ':', len)) != 0) {
+    if (!str_copyb(&params, colon + 1, len - (colon + 1 - name))) return 0;
+    writer_params = params.s;
+    len = colon - name;
+  }
   else
-    return 0;
+    writer_params = 0;
+  for (m = writer_methods; m->name != 0; ++m)
+    if (strlen(m->name) == len && memcmp(name, m->name, len) == 0)
+      return m;
+  return 0;
+}
+
+int writer_select(const char* name)
+{
+  const struct writer_method* m;
+  if ((m = writer_find(name, strlen(name))) == 0) return 0;
+  m->select();
   return 1;
 }
 
+/* Returns the usable size of the journal, as a whole number of pages
+   that fits in the 32-bit offsets used throughout. */
+static uint32 journal_size(unsigned long long size)
+{
+  uint32 max;
+  max = ((uint32)-1 / writer_pagesize) * writer_pagesize;
+  size = (size / writer_pagesize) * writer_pagesize;
+  return (size > max) ? max : (uint32)size;
+}
+
+/* A block device has no file size, and its st_blksize describes the
+   page cache rather than the device.  Its size is taken from the
+   device, and pages are made at least as large as both its logical
+   sector (the O_DIRECT alignment) and its physical sector, so a page
+   write never turns into a read-modify-write on the device. */
+static int device_geometry(unsigned long long* size)
+{
+#if defined(BLKGETSIZE64) && defined(BLKSSZGET)
+  uint64 bytes;
+  int sector;
+#ifdef BLKPBSZGET
+  unsigned int physical;
+#endif
+  if (ioctl(writer_fd, BLKGETSIZE64, &bytes) == -1) return 0;
+  *size = bytes;
+  if (ioctl(writer_fd, BLKSSZGET, &sector) == 0
+      && (unsigned)sector > writer_pagesize)
+    writer_pagesize = sector;
+#ifdef BLKPBSZGET
+  if (ioctl(writer_fd, BLKPBSZGET, &physical) == 0
+      && physical > writer_pagesize)
+    writer_pagesize = physical;
+#endif
+  return 1;
+#else
+  *size = 0;
+  return 1;
+#endif
+}
+
+int writer_is_device(const char* path)
+{
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
 int writer_open(const char* path, int flags)
 {
   struct stat st;
+  unsigned long long size;
+  /* O_EXCL without O_CREAT only has a defined meaning for devices,
+     where it fails if the device is mounted or open exclusively. */
+  if (writer_exclusive && writer_is_device(path))
+    flags |= O_EXCL;
   if ((writer_fd = open(path, O_RDWR|flags)) == -1) return 0;
   if (fstat(writer_fd, &st) == -1) return 0;
   writer_pos = 0;
-  if ((writer_pagesize = getpagesize()) < (unsigned)st.st_blksize)
-    writer_pagesize = st.st_blksize;
-  writer_size = (st.st_size / writer_pagesize) * writer_pagesize;
+  writer_pagesize = getpagesize();
+  if (S_ISBLK(st.st_mode)) {
+    if (!device_geometry(&size)) return 0;
+  }
+  else {
+    if (writer_pagesize < (unsigned)st.st_blksize)
+      writer_pagesize = st.st_blksize;
+    size = st.st_size;
+  }
+  if (writer_pagesize < writer_min_pagesize)
+    writer_pagesize = writer_min_pagesize;
+  writer_size = journal_size(size);
   return 1;
 }
 
+/* Without this, written pages sit dirty in the page cache until the
+   commit syncs them, and the device sees all of a large transaction at
+   once.  Instead, writeback of every run of writer_writeback pages is
+   started as soon as it fills, so most of it is done (or at least in
+   flight) by the time of the sync.  The writers call this after each
+   page, and writer_writeback_seek when they change position. */
+void writer_writeback_page(void)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+  uint32 len;
+  if (writer_writeback == 0) return;
+  len = writer_pos - writeback_start;
+  if (len >= (uint64)writer_writeback * writer_pagesize) {
+    sync_file_range(writer_fd, writeback_start, len, SYNC_FILE_RANGE_WRITE);
+    writeback_start = writer_pos;
+  }
+#endif
+}
+
+void writer_writeback_seek(void)
+{
+  writeback_start = writer_pos;
+}
+
+/* Writes a few bytes outside of the sequence of pages, such as the
+   resume hint, and waits for them to reach the disk.  O_DIRECT is
+   turned off around the write, which could not be aligned. */
+int writer_file_put(uint32 offset, const void* data, uint32 len)
+{
+  int flags;
+  int ok;
+  if ((flags = fcntl(writer_fd, F_GETFL)) == -1) return 0;
+#ifdef O_DIRECT
+  if (flags & O_DIRECT)
+    if (fcntl(writer_fd, F_SETFL, flags & ~O_DIRECT) == -1) return 0;
+#endif
+  ok = (uint32)pwrite(writer_fd, data, len, offset) == len
+    && fdatasync(writer_fd) == 0;
+#ifdef O_DIRECT
+  if (flags & O_DIRECT)
+    fcntl(writer_fd, F_SETFL, flags);
+#endif
+  return ok;
+}
+
 int writer_file_open_flags = 0;
 
 int writer_file_init(const char* path)
@@ -84,6 +229,7 @@ int writer_file_seek(uint32 offset)
   if ((uint32)lseek(writer_fd, offset, SEEK_SET) != offset)
     return 0;
   writer_pos = offset;
+  writer_writeback_seek();
   return 1;
 }
 
@@ -95,5 +241,8 @@ int writer_file_writepage(void)
       write(writer_fd, writer_pagebuf, writer_pagesize) != writer_pagesize)
     return 0;
   writer_pos += writer_pagesize;
+  /* Pages written with O_SYNC or O_DIRECT are already on their way. */
+  if (writer_file_open_flags == 0)
+    writer_writeback_page();
   return 1;
 }
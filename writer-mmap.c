@@ -1,55 +1,167 @@
 #include <string.h>
+#include <sys/types.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include "writer.h"
 
+/*
+  The journal is mapped one window at a time, so its size is not
+  limited by the address space.  Each window is prefaulted when it is
+  mapped, so ingestion does not stop for page faults.  The first page
+  (holding the file header) is mapped separately, and is only written
+  when the journal is started or wraps around.  The resume hint in it
+  is written through the descriptor (see writer_file_put), so it never
+  moves the window.  Past the end of the file the page buffer is a
+  spare page, so nothing written there can fault.
+
+  The dirty range [start,end) is kept in file offsets.  If the window
+  moves while part of it is unsynced, the next sync falls back to
+  fdatasync, which covers pages that are no longer mapped.
+*/
+
+uint32 writer_mmap_window = 64*1024*1024; /* zero maps the whole file */
+
 static uint32 start;
 static uint32 end;
+static int head_dirty;
+static int unmapped_dirty;
+static unsigned char* head;
+static unsigned char* spare;
 static unsigned char* map;
+static uint32 map_start;
+static uint32 map_len;
+
+#ifdef MAP_POPULATE
+#define MAP_FLAGS (MAP_SHARED|MAP_POPULATE)
+#else
+#define MAP_FLAGS MAP_SHARED
+#endif
+
+static unsigned char* map_range(uint32 offset, uint32 len)
+{
+  unsigned char* p;
+  p = mmap(0, len, PROT_READ|PROT_WRITE, MAP_FLAGS, writer_fd, offset);
+  if (p == (unsigned char*)MAP_FAILED) return 0;
+#ifdef MADV_WILLNEED
+  madvise(p, len, MADV_WILLNEED);
+#endif
+  return p;
+}
+
+static int move_window(void)
+{
+  uint32 len;
+  if (map) {
+    if (start < end) {
+      msync(map, map_len, MS_ASYNC);
+      unmapped_dirty = 1;
+    }
+    munlock(map, map_len);
+    munmap(map, map_len);
+    map = 0;
+  }
+  map_start = writer_pos;
+  len = writer_size - map_start;
+  map_len = (writer_mmap_window / writer_pagesize) * writer_pagesize;
+  if (map_len == 0 || map_len > len) map_len = len;
+  if ((map = map_range(map_start, map_len)) == 0) return 0;
+  /* Pinning the window is best effort, as it is subject to the locked
+     memory resource limit. */
+  mlock(map, map_len);
+  return 1;
+}
+
+/* Point the page buffer at the current position, moving the window if
+   the page is not in it. */
+static int set_pagebuf(void)
+{
+  if (writer_pos < writer_pagesize) {
+    writer_pagebuf = head + writer_pos;
+    head_dirty = 1;
+    return 1;
+  }
+  if (writer_pos >= writer_size) {
+    writer_pagebuf = spare;
+    return 1;
+  }
+  if (!map || writer_pos < map_start
+      || writer_pos + writer_pagesize > map_start + map_len)
+    if (!move_window()) return 0;
+  writer_pagebuf = map + (writer_pos - map_start);
+  return 1;
+}
+
+static void mark(uint32 from, uint32 to)
+{
+  if (from < writer_pagesize) return;
+  if (start == end) {
+    start = from;
+    end = to;
+  }
+  else {
+    if (from < start) start = from;
+    if (to > end) end = to;
+  }
+}
 
 static int _init(const char* path)
 {
   if (!writer_open(path, 0)) return 0;
-  if ((map = mmap(0, writer_size, PROT_WRITE, MAP_SHARED,
-		  writer_fd, 0)) == (unsigned char*)-1)
+  if ((head = map_range(0, writer_pagesize)) == 0) return 0;
+  if ((spare = mmap(0, writer_pagesize, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANON, -1, 0)) == (unsigned char*)MAP_FAILED)
     return 0;
-  writer_pagebuf = map;
+  map = 0;
   start = end = 0;
-  return 1;
+  head_dirty = unmapped_dirty = 0;
+  return set_pagebuf();
 }
 
 static int _sync(void)
 {
-  start = (start / writer_pagesize) * writer_pagesize;
-  if (msync(map + start, end-start, MS_SYNC|MS_INVALIDATE) != 0) return 0;
-  start = end = writer_pos;
+  if (unmapped_dirty) {
+    if (fdatasync(writer_fd) != 0) return 0;
+    unmapped_dirty = 0;
+  }
+  else if (start < end) {
+    if (msync(map + (start - map_start), end - start, MS_SYNC) != 0)
+      return 0;
+  }
+  if (head_dirty) {
+    if (msync(head, writer_pagesize, MS_SYNC) != 0) return 0;
+  }
+  head_dirty = writer_pos < writer_pagesize;
+  start = end = 0;
   return 1;
 }
 
 static int _seek(uint32 offset)
 {
   writer_pos = offset;
-  writer_pagebuf = map + writer_pos;
-  if (writer_pos + writer_pagesize > end)
-    end = writer_pos + writer_pagesize;
+  writer_writeback_seek();
+  if (!set_pagebuf()) return 0;
+  /* A partial page may be written at the new position. */
+  mark(writer_pos, writer_pos + writer_pagesize);
   return 1;
 }
 
 static int _writepage(void)
 {
-  if (writer_pos < start)
-    start = writer_pos;
+  if (writer_pos + writer_pagesize > writer_size) return 0;
+  mark(writer_pos, writer_pos + writer_pagesize);
   writer_pos += writer_pagesize;
-  if (writer_pos > end)
-    end = writer_pos;
-  writer_pagebuf = map + writer_pos;
-  return 1;
+  writer_writeback_page();
+  return set_pagebuf();
 }
 
+extern int writer_file_put(uint32 offset, const void* data, uint32 len);
+
 void writer_mmap_select(void)
 {
   writer_init = _init;
   writer_sync = _sync;
   writer_seek = _seek;
   writer_writepage = _writepage;
+  writer_put = writer_file_put;
 }
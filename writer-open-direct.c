@@ -19,14 +19,16 @@ extern int writer_file_open_flags;
 extern int writer_file_init(const char* path);
 extern int writer_file_seek(uint32);
 extern int writer_file_writepage(void);
+extern int writer_file_put(uint32 offset, const void* data, uint32 len);
 
 void writer_open_direct_select(void)
 {
-  writer_file_open_flags = O_DSYNC;
+  writer_file_open_flags = O_DIRECT|O_DSYNC;
   writer_init = writer_file_init;
   writer_sync = _sync;
   writer_seek = writer_file_seek;
   writer_writepage = writer_file_writepage;
+  writer_put = writer_file_put;
 }
 
 #else
@@ -18,6 +18,7 @@ extern int writer_file_open_flags;
 extern int writer_file_init(const char* path);
 extern int writer_file_seek(uint32);
 extern int writer_file_writepage(void);
+extern int writer_file_put(uint32 offset, const void* data, uint32 len);
 
 void writer_open_sync_select(void)
 {
@@ -26,4 +27,5 @@ void writer_open_sync_select(void)
   writer_sync = _sync;
   writer_seek = writer_file_seek;
   writer_writepage = writer_file_writepage;
+  writer_put = writer_file_put;
 }
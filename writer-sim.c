@@ -0,0 +1,222 @@
+/* writer-sim.c - Simulated device writer for repeatable experiments.
+   Copyright (C) 2002 Bruce Guenter
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <sys/types.h>
+#include <math.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <msg/msg.h>
+#include <uint64.h>
+
+#include "stats.h"
+#include "writer.h"
+
+/*
+  A simulated device, for repeatable experiments with the daemon.  The
+  journal is mapped privately, so written pages stay in memory, and a
+  sync copies the pages written since the last one to the file without
+  syncing it, so the file always holds what the device has made
+  durable.  Each sync then takes as long as the model says: the time to
+  transfer those pages at the given bandwidth, plus a fixed latency and
+  an exponentially distributed one drawn from a seeded generator, so a
+  run can be repeated exactly.
+
+  Parameters follow the name, separated by colons, as in
+  "sim:bw=200:lat=500:jitter=2000:seed=7:crash=100".
+    bw=N      transfer rate in MB/s (0 for unlimited, the default)
+    lat=N     fixed part of the sync latency in microseconds
+    jitter=N  mean of the random part of the sync latency in microseconds
+    seed=N    seed for the random number generator (default 1)
+    crash=N   crash during the Nth sync: only a random leading part of
+              the pages written since the previous sync reaches the
+              file, and the process is killed
+*/
+
+static unsigned long bw;
+static unsigned long lat;
+static unsigned long jitter;
+static unsigned long seed = 1;
+static unsigned long crash;
+
+static unsigned char* image;
+static unsigned char* spare;	/* the page buffer past the end */
+static uint32* dirty;
+static unsigned dirty_count;
+static unsigned dirty_size;
+static unsigned long syncs;
+static uint64 rng;
+
+/* xorshift64* */
+static uint64 random64(void)
+{
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 0x2545f4914f6cdd1dULL;
+}
+
+static double uniform(void)
+{
+  return (random64() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void sleep_until(uint64 when)
+{
+  struct timespec ts;
+  uint64 t;
+  while ((t = stats_now()) < when) {
+    ts.tv_sec = (when - t) / 1000000;
+    ts.tv_nsec = (when - t) % 1000000 * 1000;
+    nanosleep(&ts, 0);
+  }
+}
+
+static const struct
+{
+  const char* name;
+  unsigned long* value;
+} params[] = {
+  { "bw", &bw },
+  { "lat", &lat },
+  { "jitter", &jitter },
+  { "seed", &seed },
+  { "crash", &crash },
+  { 0, 0 }
+};
+
+static void parse(const char* p)
+{
+  const char* end;
+  char* num;
+  unsigned len;
+  int i;
+  while (p && *p) {
+    if ((end = strchr(p, ':')) == 0) end = p + strlen(p);
+    for (i = 0; params[i].name != 0; ++i) {
+      len = strlen(params[i].name);
+      if (strncmp(p, params[i].name, len) == 0 && p[len] == '=')
+	break;
+    }
+    if (params[i].name == 0)
+      die3(1, "Invalid sim writer parameter '", p, "'");
+    *params[i].value = strtoul(p + len + 1, &num, 10);
+    if (num != end || num == p + len + 1)
+      die3(1, "Invalid sim writer parameter '", p, "'");
+    p = *end ? end + 1 : end;
+  }
+}
+
+static void set_pagebuf(void)
+{
+  writer_pagebuf = (writer_pos < writer_size) ? image + writer_pos : spare;
+}
+
+static int _init(const char* path)
+{
+  if (!writer_open(path, 0)) return 0;
+  image = mmap(0, writer_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+	       writer_fd, 0);
+  if (image == (unsigned char*)MAP_FAILED) return 0;
+  spare = mmap(0, writer_pagesize, PROT_READ|PROT_WRITE,
+	       MAP_PRIVATE|MAP_ANON, -1, 0);
+  if (spare == (unsigned char*)MAP_FAILED) return 0;
+  rng = seed ? seed : 1;
+  dirty_count = 0;
+  syncs = 0;
+  set_pagebuf();
+  return 1;
+}
+
+static int persist(unsigned count)
+{
+  unsigned i;
+  for (i = 0; i < count; i++)
+    if ((uint32)pwrite(writer_fd, image + dirty[i], writer_pagesize, dirty[i])
+	!= writer_pagesize)
+      return 0;
+  return 1;
+}
+
+static int _sync(void)
+{
+  uint64 start;
+  uint64 delay;
+  start = stats_now();
+  delay = lat;
+  if (jitter) delay += (uint64)(-log(1.0 - uniform()) * jitter);
+  if (bw)
+    delay += (uint64)dirty_count * writer_pagesize / bw;
+  if (crash && ++syncs == crash) {
+    persist(random64() % (dirty_count + 1));
+    warn1("Simulated crash");
+    kill(getpid(), SIGKILL);
+  }
+  if (!persist(dirty_count)) return 0;
+  dirty_count = 0;
+  sleep_until(start + delay);
+  return 1;
+}
+
+static int _seek(uint32 offset)
+{
+  writer_pos = offset;
+  set_pagebuf();
+  return 1;
+}
+
+static int add_dirty(uint32 offset)
+{
+  if (dirty_count >= dirty_size) {
+    dirty_size = dirty_size ? dirty_size * 2 : 64;
+    if ((dirty = realloc(dirty, dirty_size * sizeof *dirty)) == 0) return 0;
+  }
+  dirty[dirty_count++] = offset;
+  return 1;
+}
+
+static int _writepage(void)
+{
+  if (writer_pos + writer_pagesize > writer_size) return 0;
+  if (!add_dirty(writer_pos)) return 0;
+  writer_pos += writer_pagesize;
+  set_pagebuf();
+  return 1;
+}
+
+/* Like any other write, this only reaches the file (and the model's
+   timing) with the next sync. */
+static int _put(uint32 offset, const void* data, uint32 len)
+{
+  if (offset + len > writer_size) return 0;
+  memcpy(image + offset, data, len);
+  return add_dirty(offset - offset % writer_pagesize);
+}
+
+void writer_sim_select(void)
+{
+  parse(writer_params);
+  writer_init = _init;
+  writer_sync = _sync;
+  writer_seek = _seek;
+  writer_writepage = _writepage;
+  writer_put = _put;
+}
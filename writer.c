@@ -23,17 +23,28 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <uint32.h>
 #include "flags.h"
 #include "hash.h"
+#include "jindex.h"
 #include "server.h"
+#include "stats.h"
+#include "trace.h"
 #include "writer.h"
 
 static uint32 pageoff;
 
 static uint32 global_recnum = 0;
+static uint32 first_recnum = 0;
+static int pending = 0;
+static unsigned commits = 0;
+static uint32 trans_offset = 0;
+static uint32 trans_recnum = 0;
+static uint32 commit_time = 0;
+static uint32 last_time_mark = 0;
 
 static int writer_write(const unsigned char* data, uint32 bytes)
 {
@@ -57,6 +68,27 @@ static int writer_write(const unsigned char* data, uint32 bytes)
   return 1;
 }
 
+/* Like writer_write, but the data is added to the check code as it is
+   copied into the page, instead of in a separate pass over it. */
+static int writer_write_hashed(HASH_CTX* hash,
+			       const unsigned char* data, uint32 bytes)
+{
+  uint32 available;
+  while (bytes) {
+    available = writer_pagesize - pageoff;
+    if (available > bytes) available = bytes;
+    hash_copy(hash, writer_pagebuf + pageoff, data, available);
+    data += available;
+    bytes -= available;
+    pageoff += available;
+    if (pageoff == writer_pagesize) {
+      pageoff = 0;
+      if (!writer_writepage()) return 0;
+    }
+  }
+  return 1;
+}
+
 static int write_record_raw(uint32 type,
 			    uint32 stream, uint32 record,
 			    uint32 buflen, const char* buf)
@@ -72,60 +104,163 @@ static int write_record_raw(uint32 type,
   uint32_pack_lsb(stream, header+8);
   uint32_pack_lsb(record, header+12);
   uint32_pack_lsb(buflen, header+16);
-  hash_update(&hash, header, HEADER_SIZE);
-  if (!writer_write(header, HEADER_SIZE)) return 0;
+  if (!writer_write_hashed(&hash, header, HEADER_SIZE)) return 0;
 
   /* hash/write the data */
-  hash_update(&hash, buf, buflen);
-  if (!writer_write(buf, buflen)) return 0;
+  if (!writer_write_hashed(&hash, (const unsigned char*)buf, buflen))
+    return 0;
 
   /* finish the hash and write it */
   hash_finish(&hash, hashbuf);
   if (!writer_write(hashbuf, HASH_SIZE)) return 0;
 
   global_recnum++;
+  pending = 1;
   return 1;
 }
 
+/* The end of transaction record carries the next global record number
+   and stream number, so the end of a journal can be found and verified
+   when resuming, and the time of the commit. */
+static void make_eot(unsigned char* buf)
+{
+  HASH_CTX hash;
+  uint32_pack_lsb(RECORD_EOT, buf);
+  uint32_pack_lsb(global_recnum, buf+4);
+  uint32_pack_lsb(connection_number, buf+8);
+  uint32_pack_lsb(commit_time, buf+12);
+  uint32_pack_lsb(0, buf+16);
+  hash_init(&hash);
+  hash_update(&hash, buf, HEADER_SIZE);
+  hash_finish(&hash, buf+HEADER_SIZE);
+}
+
+static int write_eot(void)
+{
+  unsigned char buf[EOT_SIZE];
+  make_eot(buf);
+  return writer_write(buf, EOT_SIZE);
+}
+
 static int write_ident(connection* con)
 {
   static char buf[4+IDENTSIZE];
   uint32_pack_lsb(con->total, buf);
   memcpy(buf+4, con->ident, con->ident_len);
+  con->info_offset = trans_offset;
+  con->info_recnum = trans_recnum;
   return write_record_raw(RECORD_INFO, con->number, con->records,
 			  con->ident_len+4, buf);
 }
 
-int sync_records(void)
+static uint32 hint_pos;
+
+/* Fill in the resume hint pointing at the given transaction offset. */
+static void make_hint(unsigned char* p, uint32 offset)
+{
+  HASH_CTX hash;
+  uint32_pack_lsb(offset, p);
+  uint32_pack_lsb(global_recnum, p+4);
+  uint32_pack_lsb(connection_number, p+8);
+  hash_init(&hash);
+  hash_update(&hash, p, 12);
+  hash_finish(&hash, p+12);
+}
+
+/* Fill in the file header, followed by the resume hint pointing at the
+   given transaction offset, and return the number of bytes used. */
+static uint32 make_file_header(uint32 hint)
+{
+  unsigned char* p = writer_pagebuf;
+  HASH_CTX hash;
+  uint32 optlen;
+  memset(p, 0, writer_pagesize);
+  memcpy(p, "journald", 8); p += 8;
+  uint32_pack_lsb(3, p); p += 4;
+  uint32_pack_lsb(writer_pagesize, p); p += 4;
+  uint32_pack_lsb(first_recnum, p); p += 4;
+  optlen = hash_make_options(p+4);
+  uint32_pack_lsb(optlen, p); p += 4 + optlen;
+  hash_init_type(&hash, HASH_CRC64);
+  hash_update(&hash, writer_pagebuf, p - writer_pagebuf);
+  hash_finish(&hash, p); p += HASH_SIZE;
+
+  hint_pos = p - writer_pagebuf;
+  make_hint(p, hint); p += HINT_SIZE;
+  commits = 0;
+  return p - writer_pagebuf;
+}
+
+/* The hint is only rewritten once the transaction it names is on disk,
+   and only its own bytes are written, so a crash part way through can
+   at worst leave a hint that fails its check code, never a damaged file
+   header or a hint pointing past data that was lost. */
+static int write_hint(uint32 offset)
+{
+  unsigned char buf[HINT_SIZE];
+  make_hint(buf, offset);
+  commits = 0;
+  return writer_put(hint_pos, buf, HINT_SIZE);
+}
+
+/* The index gets a time mark for the first commit in each interval, so
+   readers can seek to a time without scanning the journal. */
+static int add_time_mark(void)
+{
+  struct jindex_entry e;
+  if (commit_time < last_time_mark + JINDEX_TIME_INTERVAL) return 1;
+  last_time_mark = commit_time;
+  e.type = JINDEX_TIME;
+  e.strnum = commit_time;
+  memset(e.identhash, 0, sizeof e.identhash);
+  e.info_offset = e.end_offset = trans_offset;
+  e.info_recnum = e.end_recnum = trans_recnum;
+  return jindex_add(&e);
+}
+
+static int sync_pages(void)
 {
   uint32 prev;
+  uint64 start;
+  commit_time = time(0);
+  if (pending && opt_index)
+    if (!add_time_mark()) return 0;
+  if (pending) {
+    if (!write_eot()) return 0;
+    pending = 0;
+  }
   if (pageoff) {
     memset(writer_pagebuf+pageoff, 0, writer_pagesize-pageoff);
+    stats->padding += writer_pagesize - pageoff;
     if (!writer_writepage()) return 0;
   }
   pageoff = 0;
   prev = writer_pos;
   memset(writer_pagebuf, 0, writer_pagesize);
+  make_eot(writer_pagebuf);
+  stats->padding += writer_pagesize;
   if (!writer_writepage()) return 0;
+  start = stats_now();
   if (!writer_sync()) return 0;
+  hist_add(&stats->sync_latency, stats_now() - start);
+  stats->synced = global_recnum;
+  if (opt_hint_interval && ++commits >= opt_hint_interval)
+    if (!write_hint(prev)) return 0;
   if (!writer_seek(prev)) return 0;
+  trans_offset = prev;
+  trans_recnum = global_recnum;
+  jindex_flush();
   return 1;
 }
 
-static void make_file_header(void)
+int sync_records(void)
 {
-  unsigned char* p = writer_pagebuf;
-  HASH_CTX hash;
-  memset(p, 0, writer_pagesize);
-  memcpy(p, "journald", 8); p += 8;
-  uint32_pack_lsb(2, p); p += 4;
-  uint32_pack_lsb(writer_pagesize, p); p += 4;
-  uint32_pack_lsb(global_recnum, p); p += 4;
-  uint32_pack_lsb(0, p); p += 4;
-  hash_init(&hash);
-  hash_update(&hash, writer_pagebuf, p - writer_pagebuf);
-  hash_finish(&hash, p); p += HASH_SIZE;
-  pageoff = p - writer_pagebuf;
+  if (!sync_pages()) {
+    ++stats->failed_commits;
+    return 0;
+  }
+  ++stats->commits;
+  return 1;
 }
 
 int rotate_journal(void)
@@ -133,29 +268,76 @@ int rotate_journal(void)
   unsigned i;
 
   if (!sync_records()) return 0;
+  ++stats->wraps;
   sync();
   if (!writer_seek(0)) return 0;
-  make_file_header();
+  first_recnum = global_recnum;
+  pageoff = make_file_header(writer_pagesize);
   if (!sync_records()) return 0;
+  if (opt_index)
+    if (!jindex_open(opt_index, writer_pagesize, first_recnum, 0))
+      return 0;
+  last_time_mark = 0;
   
   for (i = 0; i < opt_connections; i++)
     connections[i].wrote_ident = 0;
   return 1;
 }
 
-int open_journal(const char* filename)
+/* Returns 1 on success, 0 on an error (in errno), or -1 if the journal
+   could not be resumed. */
+int open_journal(const char* filename, int resume)
 {
+  struct resume_point rp;
+  unsigned char opts[FILE_OPTIONS_MAX];
   if (writer_init(filename) == 0) return 0;
   if (writer_size < writer_pagesize * 4) return 0;
-  make_file_header();
+  stats->pagesize = writer_pagesize;
+  /* Only a file that holds no journal at all is started afresh when
+     resuming; anything else that can't be resumed is left alone. */
+  if (resume)
+    switch (resume_scan(filename, &rp)) {
+    case 0: return -1;
+    case -1: resume = 0;
+    }
+  if (resume) {
+    hash_type = rp.check;
+    hint_pos = FILE_HEADER_SIZE + hash_make_options(opts);
+    first_recnum = rp.first_recnum;
+    global_recnum = rp.recnum;
+    connection_number = rp.stream;
+    pageoff = 0;
+    if (!writer_seek(rp.offset)) return 0;
+  }
+  else {
+    first_recnum = global_recnum;
+    pageoff = make_file_header(writer_pagesize);
+  }
   if (!sync_records()) return 0;
+  if (opt_index)
+    if (!jindex_open(opt_index, writer_pagesize, first_recnum, resume))
+      return 0;
   return 1;
 }
 
+static int add_index(const connection* con)
+{
+  struct jindex_entry e;
+  e.type = JINDEX_STREAM;
+  e.strnum = con->number;
+  jindex_hash(con->ident, con->ident_len, e.identhash);
+  e.info_offset = con->info_offset;
+  e.info_recnum = con->info_recnum;
+  e.end_offset = trans_offset;
+  e.end_recnum = trans_recnum;
+  return jindex_add(&e);
+}
+
 static int check_rotate(uint32 buflen)
 {
   if (writer_pos + pageoff +
-      HEADER_SIZE + buflen + HASH_SIZE + 1 + writer_pagesize >= writer_size)
+      HEADER_SIZE + buflen + HASH_SIZE + EOT_SIZE + writer_pagesize
+      >= writer_size)
     if (!rotate_journal())
       return 0;
   return 1;
@@ -187,11 +369,17 @@ int write_record(connection* con, int final, int do_abort)
 
   if (!write_record_raw(type, con->number, con->records,
 			con->buf_length, con->buf)) return 0;
-  
+  trace(TRACE_RECORD, con->number, con->buf_length);
+
+  stats->bytes += con->buf_length;
+  ++stats->records;
   con->total += con->buf_length;
   con->records++;
   con->buf_length = 0;
 
+  if ((type & RECORD_EOS) && opt_index)
+    if (!add_index(con)) return 0;
+
   if (!check_rotate(1)) return 0;
   return 1;
 }
@@ -10,14 +10,49 @@ extern uint32 writer_pagesize;
 extern unsigned char* writer_pagebuf;
 
 extern int writer_fd;
+extern uint32 writer_min_pagesize;
+extern uint32 writer_writeback;	/* pages per early writeback, 0 for none */
+#define WRITER_WRITEBACK_MAX 65536
+extern int writer_exclusive;	/* open block devices with O_EXCL */
 
+struct writer_method
+{
+  const char* name;
+  void (*select)(void);
+};
+extern const struct writer_method writer_methods[];
+extern const char* writer_params;	/* after the colon in the name */
+
+extern const struct writer_method* writer_find(const char* name,
+					      unsigned len);
 extern int writer_select(const char* name);
+extern int writer_is_device(const char* path);
 extern int writer_open(const char* path, int flags);
+extern void writer_writeback_page(void);
+extern void writer_writeback_seek(void);
+
+/* writer-mmap.c */
+extern uint32 writer_mmap_window;
 
 /* Assigned by writer_*_select */
 extern int (*writer_init)(const char* path);
 extern int (*writer_sync)(void);
 extern int (*writer_seek)(uint32 offset);
 extern int (*writer_writepage)(void);
+/* Writes a few bytes outside of the sequence of pages and makes them
+   durable, without moving the position. */
+extern int (*writer_put)(uint32 offset, const void* data, uint32 len);
+
+/* resume.c */
+struct resume_point
+{
+  uint32 offset;
+  uint32 recnum;
+  uint32 first_recnum;
+  uint32 stream;
+  int check;			/* check code algorithm of the journal */
+};
+
+extern int resume_scan(const char* path, struct resume_point* rp);
 
 #endif